@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,6 +12,31 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// The buffers are allocated at boot, as many as a fraction of
+// free memory holds, between NBUF and NBUFMAX.
+//
+// Each hash bucket has its own lock, so lookups of blocks in
+// different buckets don't contend. Buffers no one is using are
+// also on bcache.lru, least recently used first, and a miss
+// recycles the one at its head, which may live in any bucket.
+// bcache.lock serializes those evictions, so the one process
+// evicting may hold two bucket locks at once while every other
+// process holds at most one. bcache.lrulock protects the list
+// and is taken after any bucket lock.
+//
+// The disk driver can have many requests in flight, so there
+// are asynchronous variants too:
+// * breadahead() starts reading blocks into buffers without
+//     waiting; the disk interrupt releases the buffers when the
+//     data is in, and a later bread() finds them cached.
+// * bwrite_async() starts a write; the caller either waits for
+//     it with bwait() or has the disk interrupt call a function,
+//     which releases the buffer with brelse_done().
+// * bwritev_async() starts writing several buffers at once.
+// Runs of consecutive blocks among the buffers passed to
+// breadahead() and bwritev_async() go to the disk as single
+// requests.
 
 
 #include "types.h"
@@ -23,33 +48,174 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define NBUCKET 127
+#define BCACHEFRAC 32  // use 1/BCACHEFRAC of free memory
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf head;    // list of buffers hashed here, through prev/next
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  struct spinlock lock;   // serializes evictions
+  int nbuf;
+  struct bucket bucket[NBUCKET];
+  struct spinlock lrulock;
+  struct buf lru;         // unused buffers, through lruprev/lrunext
 } bcache;
 
+// Put unused buffer b at the most recently used end of
+// bcache.lru. Caller must hold b's bucket lock.
+static void
+lruput(struct buf *b)
+{
+  acquire(&bcache.lrulock);
+  b->lrunext = &bcache.lru;
+  b->lruprev = bcache.lru.lruprev;
+  bcache.lru.lruprev->lrunext = b;
+  bcache.lru.lruprev = b;
+  release(&bcache.lrulock);
+}
+
+// Take b off bcache.lru. Caller must hold b's bucket lock.
+static void
+lrutake(struct buf *b)
+{
+  acquire(&bcache.lrulock);
+  b->lrunext->lruprev = b->lruprev;
+  b->lruprev->lrunext = b->lrunext;
+  release(&bcache.lrulock);
+}
+
+// Add a reference to b. Caller must hold b's bucket lock.
+static void
+bhold(struct buf *b)
+{
+  if(b->refcnt++ == 0)
+    lrutake(b);
+}
+
+// Drop a reference to b. Caller must hold b's bucket lock.
+static void
+bunhold(struct buf *b)
+{
+  if(--b->refcnt == 0)
+    lruput(b);
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct buf *b, *hdrs;
+  struct bucket *bk;
+  uchar *data;
+  int i, n;
 
   initlock(&bcache.lock, "bcache");
+  initlock(&bcache.lrulock, "bcache.lru");
+  bcache.lru.lruprev = &bcache.lru;
+  bcache.lru.lrunext = &bcache.lru;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
+
+  n = kfreepages() / BCACHEFRAC * (PGSIZE / BSIZE);
+  if(n < NBUF)
+    n = NBUF;
+  if(n > NBUFMAX)
+    n = NBUFMAX;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  // Start with all buffers in bucket 0; bget() moves them
+  // to the right bucket as they are assigned blocks.
+  // Pack the bufs, and separately their data, into pages.
+  bk = &bcache.bucket[0];
+  hdrs = 0;
+  data = 0;
+  for(i = 0; i < n; i++){
+    if(i % (PGSIZE / sizeof(struct buf)) == 0){
+      if((hdrs = kalloc()) == 0)
+        panic("binit");
+      memset(hdrs, 0, PGSIZE);
+    }
+    if(i % (PGSIZE / BSIZE) == 0 && (data = kalloc()) == 0)
+      panic("binit");
+    b = &hdrs[i % (PGSIZE / sizeof(struct buf))];
+    b->data = data + (i % (PGSIZE / BSIZE)) * BSIZE;
+    b->next = bk->head.next;
+    b->prev = &bk->head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    bk->head.next->prev = b;
+    bk->head.next = b;
+    lruput(b);
+  }
+  bcache.nbuf = n;
+}
+
+// Return the number of buffers in the cache.
+int
+bcachesize(void)
+{
+  return bcache.nbuf;
+}
+
+// Find the buffer for a block in bucket bk.
+// Caller must hold bk->lock.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head.next; b != &bk->head; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Recycle the least recently used (LRU) unused buffer for
+// block blockno, moving it into bucket bk, and return it with
+// refcnt 1, or return 0 if every buffer is in use.
+// Caller must hold bcache.lock and bk->lock.
+static struct buf*
+brecycle(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *victim;
+  struct bucket *vbk;
+
+  for(;;){
+    acquire(&bcache.lrulock);
+    victim = bcache.lru.lrunext;
+    release(&bcache.lrulock);
+    if(victim == &bcache.lru)
+      return 0;
+    // only evictions change a buffer's block, and the caller
+    // holds bcache.lock, so victim stays in vbk.
+    vbk = &bcache.bucket[BHASH(victim->dev, victim->blockno)];
+    if(vbk != bk)
+      acquire(&vbk->lock);
+    if(victim->refcnt == 0)
+      break;
+    // a bget() took it meanwhile; try the next one.
+    if(vbk != bk)
+      release(&vbk->lock);
   }
+  bhold(victim);
+
+  if(vbk != bk){
+    victim->next->prev = victim->prev;
+    victim->prev->next = victim->next;
+    release(&vbk->lock);
+    victim->next = bk->head.next;
+    victim->prev = &bk->head;
+    bk->head.next->prev = victim;
+    bk->head.next = victim;
+  }
+  victim->dev = dev;
+  victim->blockno = blockno;
+  victim->valid = 0;
+  return victim;
 }
 
 // Look through buffer cache for block on device dev.
@@ -59,33 +225,38 @@ static struct buf*
 bget(uint dev, uint blockno)
 {
   struct buf *b;
+  struct bucket *bk;
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[BHASH(dev, blockno)];
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0){
+    bhold(b);
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bk->lock);
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  // Not cached. Check again once evictions are serialized,
+  // since another process may have just read the same block.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0){
+    bhold(b);
+    release(&bk->lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
   }
-  panic("bget: no buffers");
+
+  if((b = brecycle(bk, dev, blockno)) == 0)
+    panic("bget: no buffers");
+  release(&bk->lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -102,6 +273,108 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Drop a reference to b, whose sleep-lock the caller has
+// released. If no one else is using it, it becomes the most
+// recently used buffer on bcache.lru.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk;
+
+  bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+  acquire(&bk->lock);
+  bunhold(b);
+  release(&bk->lock);
+}
+
+// Called by the disk interrupt when a read started by
+// breadahead() completes.
+static void
+breadahead_done(struct buf *b)
+{
+  b->valid = 1;
+  brelse_done(b);
+}
+
+// Start the disk reading or writing the n locked buffers in bs,
+// with one request for each run of consecutive blocks.
+static void
+bstart(struct buf **bs, int n, int write)
+{
+  int i, j;
+
+  for(i = 0; i < n; i = j){
+    for(j = i+1; j < n && j-i < MAXIOBLOCKS; j++)
+      if(bs[j]->dev != bs[i]->dev || bs[j]->blockno != bs[j-1]->blockno+1)
+        break;
+    virtio_disk_start(bs+i, j-i, write);
+  }
+}
+
+// Set *bp to a locked buffer for the indicated block that
+// read-ahead should read, or to 0 if the block is already
+// cached. Returns -1 if every buffer is in use, else 0.
+static int
+bgetahead(uint dev, uint blockno, struct buf **bp)
+{
+  struct buf *b;
+  struct bucket *bk;
+  int r;
+
+  bk = &bcache.bucket[BHASH(dev, blockno)];
+  *bp = 0;
+
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b != 0)
+    return 0;
+
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  r = 0;
+  if(bfind(bk, dev, blockno) == 0){
+    if((b = brecycle(bk, dev, blockno)) != 0){
+      // Lock b before anyone else can find it, so that a bread()
+      // of the same block waits for the disk. b was unused, so
+      // its sleep-lock is free and this does not sleep.
+      acquiresleep(&b->lock);
+      *bp = b;
+    } else {
+      r = -1;
+    }
+  }
+  release(&bk->lock);
+  release(&bcache.lock);
+  return r;
+}
+
+// Start reading the n blocks starting at blockno into the
+// cache, and return without waiting for them. Skips blocks
+// that are already cached, and stops early if every buffer
+// is in use.
+void
+breadahead(uint dev, uint blockno, int n)
+{
+  struct buf *b, *bs[MAXIOBLOCKS];
+  int i, m, full;
+
+  full = 0;
+  for(i = 0; i < n && !full; ){
+    for(m = 0; m < MAXIOBLOCKS && i < n; i++){
+      if(bgetahead(dev, blockno+i, &b) < 0){
+        full = 1;
+        break;
+      }
+      if(b != 0){
+        b->iodone = breadahead_done;
+        bs[m++] = b;
+      }
+    }
+    bstart(bs, m, 0);
+  }
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,8 +384,44 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Start writing b's contents to disk, and return without
+// waiting. b must be locked and stay locked until the write
+// is done: if done is 0, the caller waits for it with bwait();
+// otherwise the disk interrupt calls done(b).
+void
+bwrite_async(struct buf *b, void (*done)(struct buf*))
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_async");
+  b->iodone = done;
+  virtio_disk_start(&b, 1, 1);
+}
+
+// Start writing the n locked buffers in bs to disk, and return
+// without waiting. The caller waits for each with bwait().
+void
+bwritev_async(struct buf **bs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwritev_async");
+    bs[i]->iodone = 0;
+  }
+  bstart(bs, n, 1);
+}
+
+// Wait for the write started on locked buffer b to finish.
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  virtio_disk_wait(b);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +429,35 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
+  bput(b);
+}
 
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+// Release a locked buffer from a bwrite_async() done function.
+// The disk interrupt runs on behalf of no particular process,
+// so it cannot check who holds the lock as brelse() does.
+void
+brelse_done(struct buf *b)
+{
+  releasesleep(&b->lock);
+  bput(b);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt++;
-  release(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
+  bhold(b);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt--;
-  release(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
+  bunhold(b);
+  release(&bk->lock);
 }
 
 
@@ -5,8 +5,12 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  void (*iodone)(struct buf*); // if set, disk interrupt calls it on completion
+  struct buf *ionext; // next buf in the same disk request
+  struct buf *prev; // hash bucket list
   struct buf *next;
-  uchar data[BSIZE];
+  struct buf *lruprev; // bcache.lru, while refcnt is 0
+  struct buf *lrunext;
+  uchar *data;      // BSIZE bytes
 };
 
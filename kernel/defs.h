@@ -2,10 +2,13 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct lockstat;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
+struct rwspinlock;
+struct rwsleeplock;
 struct stat;
 struct superblock;
 
@@ -13,9 +16,15 @@ struct superblock;
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
+void            brelse_done(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+void            breadahead(uint, uint, int);
+void            bwrite_async(struct buf*, void (*)(struct buf*));
+void            bwritev_async(struct buf**, int);
+void            bwait(struct buf*);
+int             bcachesize(void);
 
 // console.c
 void            consoleinit(void);
@@ -25,6 +34,12 @@ void            consputc(int);
 // exec.c
 int             exec(char*, char**);
 
+// textcache.c
+void            textinit(void);
+void*           textget(struct inode*, uint, uint);
+void            textinval(struct inode*);
+int             textreclaim(void);
+
 // file.c
 struct file*    filealloc(void);
 void            fileclose(struct file*);
@@ -37,13 +52,18 @@ int             filewrite(struct file*, uint64, int n);
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
+void            dirunlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+void            iexec(struct inode*);
+void            iunexec(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
+void            ilockshared(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
+void            iunlockshared(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
@@ -63,6 +83,9 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            krefinc(void *);
+int             krefcnt(void *);
+int             kfreepages(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -103,6 +126,8 @@ void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
+void            preempt(void);
+int             setpriority(int, int);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
@@ -112,9 +137,17 @@ void            swtch(struct context*, struct context*);
 
 // spinlock.c
 void            acquire(struct spinlock*);
+void            freelock(struct spinlock*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+int             lockstat(struct lockstat*, int);
 void            release(struct spinlock*);
+void            initrwlock(struct rwspinlock*, char*);
+void            racquire(struct rwspinlock*);
+void            rrelease(struct rwspinlock*);
+void            wacquire(struct rwspinlock*);
+void            wrelease(struct rwspinlock*);
+int             wholding(struct rwspinlock*);
 void            push_off(void);
 void            pop_off(void);
 
@@ -123,6 +156,12 @@ void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
+void            initrwsleeplock(struct rwsleeplock*, char*);
+void            racquiresleep(struct rwsleeplock*);
+void            rreleasesleep(struct rwsleeplock*);
+void            wacquiresleep(struct rwsleeplock*);
+void            wreleasesleep(struct rwsleeplock*);
+int             wholdingsleep(struct rwsleeplock*);
 
 // string.c
 int             memcmp(const void*, const void*, uint);
@@ -141,7 +180,12 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// start.c
+int             timerticked(void);
+void            timeridle(int);
+
 // trap.c
+int             sleepuntil(uint64);
 extern uint     ticks;
 void            trapinit(void);
 void            trapinithart(void);
@@ -165,6 +209,9 @@ void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcow(pagetable_t, uint64);
+int             uvmfault(struct proc*, uint64, int);
+int             uvmprefault(uint64, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -183,6 +230,8 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
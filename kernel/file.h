@@ -18,15 +18,26 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
-  struct sleeplock lock; // protects everything below here
+  int nexec;          // Processes running it, see iexec()
+  int textcached;     // textget() may have cached pages of it
+  struct inode *next; // hash chain, see iget()
+  struct rwsleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
+  // hints, which readi() updates with ip->lock only shared.
+  uint nextbn;        // block after the last one readi() read
+  uint rabn;          // read-ahead has been started up to here
+  uint lastaddr;      // disk block bmap() last allocated; allocation goal
+
+  uint dirhint;       // directory entries before here are in use
+
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint flags;
+  uint addrs[NADDRS];
 };
 
 // map major device number to device functions.
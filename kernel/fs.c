@@ -26,6 +26,8 @@
 // only one device
 struct superblock sb; 
 
+static void bsuminit(int);
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -44,6 +46,7 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bsuminit(dev);
 }
 
 // Zero a block.
@@ -59,27 +62,103 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// The free bitmap is summarized in memory by the number of
+// free blocks each bitmap block covers, so that balloc() can
+// skip full groups without reading them. balloc() starts
+// looking at a goal block, normally the one after the block
+// the file allocated last, so files tend to be laid out
+// contiguously.
+
+#define NBGROUP (FSSIZE/BPB + 1)
+
+struct {
+  struct spinlock lock;
+  uint ngroup;            // bitmap blocks in use
+  uint nfree[NBGROUP];    // free blocks covered by each bitmap block
+  uint next;              // goal for allocations without one
+} bsum;
+
+// Count the free blocks covered by each bitmap block.
+static void
+bsuminit(int dev)
+{
+  struct buf *bp;
+  uint g, b, bi;
+
+  initlock(&bsum.lock, "bsum");
+  bsum.ngroup = (sb.size + BPB - 1) / BPB;
+  if(bsum.ngroup > NBGROUP)
+    panic("bsuminit: file system too big");
+  for(g = 0; g < bsum.ngroup; g++){
+    bp = bread(dev, BBLOCK(g*BPB, sb));
+    bsum.nfree[g] = 0;
+    for(bi = 0, b = g*BPB; bi < BPB && b < sb.size; bi++, b++){
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        bsum.nfree[g]++;
+    }
+    brelse(bp);
+  }
+}
+
+// Return the first clear bit at or after bit start in bitmap
+// block data, below bit end, or -1.
+static int
+bfirstfree(uchar *data, uint start, uint end)
+{
+  uint bi;
+
+  for(bi = start; bi < end; bi++){
+    if(bi % 8 == 0){
+      // skip whole bytes of used blocks.
+      while(bi + 8 <= end && data[bi/8] == 0xff)
+        bi += 8;
+      if(bi >= end)
+        break;
+    }
+    if((data[bi/8] & (1 << (bi % 8))) == 0)
+      return bi;
+  }
+  return -1;
+}
 
-// Allocate a zeroed disk block.
+// Allocate a zeroed disk block, the free one closest after
+// goal if possible; if goal is 0, after the last block that
+// was allocated.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc(uint dev, uint goal)
 {
-  int b, bi, m;
+  uint n, g, g0, start, end, b;
+  int bi;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  if(goal == 0 || goal >= sb.size)
+    goal = bsum.next;
+  g0 = goal / BPB;
+
+  // the goal's group from the goal on, then the other groups
+  // in order, then the start of the goal's group.
+  for(n = 0; n <= bsum.ngroup; n++){
+    g = (g0 + n) % bsum.ngroup;
+    if(__atomic_load_n(&bsum.nfree[g], __ATOMIC_RELAXED) == 0)
+      continue;
+    start = n == 0 ? goal % BPB : 0;
+    end = n == bsum.ngroup ? goal % BPB : BPB;
+    if(g*BPB + end > sb.size)
+      end = sb.size - g*BPB;
+    bp = bread(dev, BBLOCK(g*BPB, sb));
+    if((bi = bfirstfree(bp->data, start, end)) >= 0){
+      bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+      log_write(bp);
+      acquire(&bsum.lock);
+      bsum.nfree[g]--;
+      bsum.next = g*BPB + bi + 1;
+      release(&bsum.lock);
+      brelse(bp);
+      b = g*BPB + bi;
+      bzero(dev, b);
+      return b;
     }
     brelse(bp);
   }
@@ -101,6 +180,9 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  acquire(&bsum.lock);
+  bsum.nfree[b / BPB]++;
+  release(&bsum.lock);
   brelse(bp);
 }
 
@@ -164,33 +246,195 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The table is a hash table of NIBUCKET buckets, each a chain
+// of the entries for the inodes that hash there, so that iget()
+// needn't look at every entry. Each bucket has a spin-lock that
+// protects its chain. Since ip->ref indicates whether an entry
+// is free, and ip->dev and ip->inum indicate which i-node an
+// entry holds, one must hold the lock of the entry's bucket
+// while using any of those fields.
+//
+// iinit() sizes the table once, by the amount of free memory
+// at boot, and puts every entry on a list of unused ones.
+// iget() takes entries from that list until it is empty, then
+// recycles a free entry, which may be in any bucket.
+// itable.lock serializes taking and recycling entries, so the
+// process doing so may hold several bucket locks at once while
+// every other process holds at most one.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
+// dev, inum and next.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
+// ip->lock is a reader-writer lock: ilock() takes it to write,
+// and ilockshared() takes it to read, so that processes can
+// readi() an inode at the same time.
+//
+// The bucket locks are reader-writer locks too, so that iget()
+// calls that find their inode in the table, and idup(), don't
+// serialize: they hold the bucket lock to read, and increment
+// ip->ref atomically. Everything else that changes ref, dev,
+// inum or next holds the bucket lock to write.
+
+#define NIBUCKET 61
+#define ICACHEFRAC 64  // use at most 1/ICACHEFRAC of free memory
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIBUCKET)
+#define IPERPAGE (PGSIZE / sizeof(struct inode))
+
+struct ibucket {
+  struct rwspinlock lock;
+  struct inode *head;
+};
 
 struct {
-  struct spinlock lock;
-  struct inode inode[NINODE];
+  struct spinlock lock;   // serializes taking and recycling entries
+  struct inode *unused;   // entries never used, chained by next
+  int rotor;              // bucket to start looking for a free entry
+  struct ibucket bucket[NIBUCKET];
 } itable;
 
+static struct inode* iget(uint dev, uint inum);
+
+// Directory-entry cache.
+//
+// The dcache remembers the results of recent lookups, so that
+// namex() can resolve a path component without locking the
+// directory and reading its blocks. An entry maps (dev, directory
+// inum, name) to the inode number the name had, or to 0 if the
+// directory had no such name. Entries are only added and changed
+// while holding the directory's ip->lock, by dirlookup(), dirlink()
+// and dirunlink(), so they always agree with the directory's
+// contents on disk; iput() drops a directory's entries when it
+// frees the directory's inode. The cache is DASSOC-way set
+// associative; within a set, the least recently used entry is
+// replaced.
+
+#define DASSOC 4
+#define NDSET (NDENTRY / DASSOC)
+
+struct dentry {
+  uint dev;
+  uint dinum;          // directory the name is in; 0 if unused
+  uint inum;           // 0 for a name that isn't there
+  uint used;           // dcache.clock at last use
+  char name[DIRSIZ];
+};
+
+struct {
+  struct spinlock lock;
+  uint clock;
+  struct dentry dentry[NDENTRY];
+} dcache;
+
+static struct dentry*
+dset(uint dev, uint dinum, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev * 31 + dinum;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &dcache.dentry[(h % NDSET) * DASSOC];
+}
+
+static struct dentry*
+dfind(uint dev, uint dinum, char *name)
+{
+  struct dentry *d, *set;
+
+  set = dset(dev, dinum, name);
+  for(d = set; d < set + DASSOC; d++)
+    if(d->dinum == dinum && d->dev == dev && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// Look up name in directory (dev, dinum) in the dcache.
+// On a hit, set *ipp to the named inode, or to 0 if the
+// name isn't there, and return 1. On a miss, return 0.
+static int
+dcachelookup(uint dev, uint dinum, char *name, struct inode **ipp)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dev, dinum, name)) == 0){
+    release(&dcache.lock);
+    return 0;
+  }
+  d->used = ++dcache.clock;
+  // iget() while still holding dcache.lock, so that an unlink
+  // can't free the inode first.
+  *ipp = d->inum ? iget(dev, d->inum) : 0;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name in directory dp refers to inode inum
+// (0 if there is no such name). Caller must hold dp->lock.
+static void
+dcacheset(struct inode *dp, char *name, uint inum)
+{
+  struct dentry *d, *e, *set;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp->dev, dp->inum, name)) == 0){
+    set = dset(dp->dev, dp->inum, name);
+    d = set;
+    for(e = set + 1; e < set + DASSOC; e++)
+      if(e->used < d->used)
+        d = e;
+    d->dev = dp->dev;
+    d->dinum = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+  }
+  d->inum = inum;
+  d->used = ++dcache.clock;
+  release(&dcache.lock);
+}
+
+// Drop all entries for directory dp, which is being freed.
+static void
+dcachepurge(struct inode *dp)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.dentry; d < dcache.dentry + NDENTRY; d++)
+    if(d->dinum == dp->inum && d->dev == dp->dev)
+      d->dinum = 0;
+  release(&dcache.lock);
+}
+
 void
 iinit()
 {
-  int i = 0;
+  struct ibucket *bk;
+  struct inode *page, *ip;
+  int n, max;
   
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  initlock(&dcache.lock, "dcache");
+  for(bk = itable.bucket; bk < itable.bucket+NIBUCKET; bk++)
+    initrwlock(&bk->lock, "itable.bucket");
+
+  max = kfreepages() / ICACHEFRAC * IPERPAGE;
+  if(max < NINODE)
+    max = NINODE;
+  if(max > NINODEMAX)
+    max = NINODEMAX;
+  for(n = 0; n < max; ){
+    if((page = kalloc()) == 0)
+      panic("iinit");
+    memset(page, 0, PGSIZE);
+    for(ip = page; ip < page + IPERPAGE && n < max; ip++, n++){
+      initrwsleeplock(&ip->lock, "inode");
+      ip->next = itable.unused;
+      itable.unused = ip;
+    }
   }
 }
 
-static struct inode* iget(uint dev, uint inum);
-
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
 // Returns an unlocked but allocated and referenced inode,
@@ -235,55 +479,145 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
+  dip->flags = ip->flags;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
 }
 
+// Find the entry for inode inum on device dev in bucket bk.
+// Caller must hold bk->lock.
+static struct inode*
+ifind(struct ibucket *bk, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = bk->head; ip; ip = ip->next)
+    if(ip->dev == dev && ip->inum == inum)
+      return ip;
+  return 0;
+}
+
+// Take a table entry that has never been used, or return 0
+// if there are none left. Caller must hold itable.lock.
+static struct inode*
+inew(void)
+{
+  struct inode *ip;
+
+  if((ip = itable.unused) != 0)
+    itable.unused = ip->next;
+  return ip;
+}
+
+// Take an unused entry out of whichever bucket it is in,
+// or return 0 if every entry is in use.
+// Caller must hold itable.lock and bk->lock to write.
+static struct inode*
+irecycle(struct ibucket *bk)
+{
+  struct ibucket *c;
+  struct inode **pp, *ip;
+  int i;
+
+  for(i = 0; i < NIBUCKET; i++){
+    c = &itable.bucket[(itable.rotor + i) % NIBUCKET];
+    if(c != bk)
+      wacquire(&c->lock);
+    for(pp = &c->head; (ip = *pp) != 0; pp = &ip->next){
+      if(ip->ref == 0){
+        // the entry's next inode must not find its pages.
+        textinval(ip);
+        *pp = ip->next;
+        if(c != bk)
+          wrelease(&c->lock);
+        itable.rotor = (c - itable.bucket + 1) % NIBUCKET;
+        return ip;
+      }
+    }
+    if(c != bk)
+      wrelease(&c->lock);
+  }
+  return 0;
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct ibucket *bk;
+  struct inode *ip;
 
-  acquire(&itable.lock);
+  bk = &itable.bucket[IHASH(dev, inum)];
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+  racquire(&bk->lock);
+  if((ip = ifind(bk, dev, inum)) != 0){
+    __atomic_fetch_add(&ip->ref, 1, __ATOMIC_RELAXED);
+    rrelease(&bk->lock);
+    return ip;
   }
+  rrelease(&bk->lock);
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
-  ip->dev = dev;
-  ip->inum = inum;
-  ip->ref = 1;
-  ip->valid = 0;
+  // Not there. Check again holding itable.lock, since another
+  // process may have added it meanwhile, then take a new or
+  // recycled entry.
+  acquire(&itable.lock);
+  wacquire(&bk->lock);
+  if((ip = ifind(bk, dev, inum)) != 0){
+    ip->ref++;
+  } else {
+    if((ip = inew()) == 0 && (ip = irecycle(bk)) == 0)
+      panic("iget: no inodes");
+    ip->next = bk->head;
+    bk->head = ip;
+    ip->dev = dev;
+    ip->inum = inum;
+    ip->ref = 1;
+    ip->valid = 0;
+    ip->nextbn = 0;
+    ip->rabn = 0;
+    ip->lastaddr = 0;
+    ip->dirhint = 0;
+    ip->nexec = 0;
+    ip->textcached = 0;
+  }
+  wrelease(&bk->lock);
   release(&itable.lock);
 
   return ip;
 }
 
+// Record that a process runs ip as its program (p->exe), and
+// iunexec() that it no longer does. Page faults read program
+// pages from ip as the program runs, so while any process runs
+// it, writei() refuses to change it and open() refuses to open
+// it for writing. Caller holds a reference to ip.
+void
+iexec(struct inode *ip)
+{
+  __atomic_fetch_add(&ip->nexec, 1, __ATOMIC_RELAXED);
+}
+
+void
+iunexec(struct inode *ip)
+{
+  __atomic_fetch_sub(&ip->nexec, 1, __ATOMIC_RELAXED);
+}
+
 // Increment reference count for ip.
 // Returns ip to enable ip = idup(ip1) idiom.
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
-  ip->ref++;
-  release(&itable.lock);
+  struct ibucket *bk;
+
+  bk = &itable.bucket[IHASH(ip->dev, ip->inum)];
+  racquire(&bk->lock);
+  __atomic_fetch_add(&ip->ref, 1, __ATOMIC_RELAXED);
+  rrelease(&bk->lock);
   return ip;
 }
 
@@ -298,7 +632,7 @@ ilock(struct inode *ip)
   if(ip == 0 || ip->ref < 1)
     panic("ilock");
 
-  acquiresleep(&ip->lock);
+  wacquiresleep(&ip->lock);
 
   if(ip->valid == 0){
     bp = bread(ip->dev, IBLOCK(ip->inum, sb));
@@ -308,6 +642,7 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
+    ip->flags = dip->flags;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
     ip->valid = 1;
@@ -320,10 +655,39 @@ ilock(struct inode *ip)
 void
 iunlock(struct inode *ip)
 {
-  if(ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
+  if(ip == 0 || !wholdingsleep(&ip->lock) || ip->ref < 1)
     panic("iunlock");
 
-  releasesleep(&ip->lock);
+  wreleasesleep(&ip->lock);
+}
+
+// Lock the given inode shared, for reading with readi().
+// Reads the inode from disk if necessary.
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  racquiresleep(&ip->lock);
+  if(ip->valid == 0){
+    // reading the inode in needs it locked exclusively.
+    // it stays valid while we hold a reference.
+    rreleasesleep(&ip->lock);
+    ilock(ip);
+    iunlock(ip);
+    racquiresleep(&ip->lock);
+  }
+}
+
+// Unlock an inode locked with ilockshared().
+void
+iunlockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("iunlockshared");
+
+  rreleasesleep(&ip->lock);
 }
 
 // Drop a reference to an in-memory inode.
@@ -336,29 +700,34 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bk;
+
+  bk = &itable.bucket[IHASH(ip->dev, ip->inum)];
+  wacquire(&bk->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
 
     // ip->ref == 1 means no other process can have ip locked,
-    // so this acquiresleep() won't block (or deadlock).
-    acquiresleep(&ip->lock);
+    // so this wacquiresleep() won't block (or deadlock).
+    wacquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    wrelease(&bk->lock);
 
     itrunc(ip);
+    if(ip->type == T_DIR)
+      dcachepurge(ip);
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
 
-    releasesleep(&ip->lock);
+    wreleasesleep(&ip->lock);
 
-    acquire(&itable.lock);
+    wacquire(&bk->lock);
   }
 
   ip->ref--;
-  release(&itable.lock);
+  wrelease(&bk->lock);
 }
 
 // Common idiom: unlock, then put.
@@ -374,50 +743,228 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT], and the ones after
+// that in the doubly- and triply-indirect trees rooted at
+// ip->addrs[NDIRECT+1] and ip->addrs[NDIRECT+2].
+//
+// Alternatively, if IF_EXTENT is set in ip->flags, ip->addrs[]
+// holds extents (see fs.h), which map a file laid out in long
+// runs of consecutive blocks with one lookup per run.
+
+static uint emap(struct inode*, uint, int);
+
+// Where to try to allocate ip's next block: just after the
+// block bmap() last allocated for it.
+#define BGOAL(ip) ((ip)->lastaddr ? (ip)->lastaddr + 1 : 0)
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmapx allocates one if alloc is
+// set, and otherwise returns 0.
 // returns 0 if out of disk space.
 static uint
-bmap(struct inode *ip, uint bn)
+bmapx(struct inode *ip, uint bn, int alloc)
 {
-  uint addr, *a;
+  uint addr, *a, level, span;
   struct buf *bp;
 
+  if(ip->flags & IF_EXTENT)
+    return emap(ip, bn, alloc);
+
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+      if(!alloc)
+        return 0;
+      addr = balloc(ip->dev, BGOAL(ip));
       if(addr == 0)
         return 0;
       ip->addrs[bn] = addr;
+      ip->lastaddr = addr;
     }
     return addr;
   }
   bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
-    }
+  // Find the indirect tree that holds bn: addrs[NDIRECT] maps
+  // NINDIRECT blocks through one level of indirect blocks,
+  // addrs[NDIRECT+1] the next NDINDIRECT through two, and so on.
+  for(level = 1, span = NINDIRECT; bn >= span; level++, span *= NINDIRECT){
+    if(level == NLEVEL)
+      panic("bmap: out of range");
+    bn -= span;
+  }
+
+  // Load the top indirect block, allocating if necessary.
+  if((addr = ip->addrs[NDIRECT+level-1]) == 0){
+    if(!alloc)
+      return 0;
+    addr = balloc(ip->dev, BGOAL(ip));
+    if(addr == 0)
+      return 0;
+    ip->addrs[NDIRECT+level-1] = addr;
+    ip->lastaddr = addr;
+  }
+
+  // Walk down, allocating indirect blocks and the data block
+  // as necessary.
+  for(; level > 0; level--){
+    span /= NINDIRECT;  // blocks under each entry at this level
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
+    if((addr = a[bn / span]) == 0 && alloc){
+      addr = balloc(ip->dev, BGOAL(ip));
       if(addr){
-        a[bn] = addr;
+        a[bn / span] = addr;
         log_write(bp);
+        ip->lastaddr = addr;
       }
     }
     brelse(bp);
-    return addr;
+    if(addr == 0)
+      return 0;
+    bn %= span;
+  }
+  return addr;
+}
+
+static uint
+bmap(struct inode *ip, uint bn)
+{
+  return bmapx(ip, bn, 1);
+}
+
+// bmap() for IF_EXTENT inodes. File blocks are allocated in
+// order, since writei() never leaves holes, so if no extent
+// maps bn it is the block just past the last one. Allocate it
+// next to the last one if possible, growing that extent, or
+// return 0 if alloc is not set.
+static uint
+emap(struct inode *ip, uint bn, int alloc)
+{
+  struct extent *e, *last;
+  struct buf *bp;
+  uint base, addr;
+  int i, n, dirty, lastinbp;
+
+  // Look through the extents in the inode, then in the
+  // extent block.
+  bp = 0;
+  e = (struct extent*)ip->addrs;
+  n = NIEXTENT;
+  last = 0;
+  lastinbp = 0;
+  base = 0;
+  for(i = 0; ; i++){
+    if(i == n && bp == 0 && ip->addrs[NADDRS-1]){
+      bp = bread(ip->dev, ip->addrs[NADDRS-1]);
+      e = (struct extent*)bp->data;
+      n = NBEXTENT;
+      i = 0;
+    }
+    if(i == n || e[i].len == 0)
+      break;
+    if(bn < base + e[i].len){
+      addr = e[i].start + (bn - base);
+      if(bp)
+        brelse(bp);
+      return addr;
+    }
+    base += e[i].len;
+    last = &e[i];
+    lastinbp = bp != 0;
+  }
+  if(!alloc){
+    addr = 0;
+    goto out;
+  }
+  if(bn != base)
+    panic("emap: hole");
+
+  // e[i], if i < n, is the first unused extent.
+  // extents in the extent block need logging; the inode's
+  // own extents are written by the caller's iupdate().
+  addr = balloc(ip->dev, last ? last->start + last->len : BGOAL(ip));
+  if(addr == 0)
+    goto out;
+  if(last && addr == last->start + last->len){
+    last->len++;
+    dirty = lastinbp;
+  } else if(i < n){
+    e[i].start = addr;
+    e[i].len = 1;
+    dirty = bp != 0;
+  } else if(bp == 0){
+    // the inode's extents are full; start the extent block.
+    if((ip->addrs[NADDRS-1] = balloc(ip->dev, addr + 1)) == 0){
+      bfree(ip->dev, addr);
+      return 0;
+    }
+    bp = bread(ip->dev, ip->addrs[NADDRS-1]);
+    e = (struct extent*)bp->data;
+    e[0].start = addr;
+    e[0].len = 1;
+    dirty = 1;
+  } else {
+    // out of extents.
+    bfree(ip->dev, addr);
+    addr = 0;
+    goto out;
+  }
+  if(dirty)
+    log_write(bp);
+
+out:
+  if(bp)
+    brelse(bp);
+  return addr;
+}
+
+// Free block addr and, if it is an indirect block with
+// level levels below it, all the blocks it points to.
+static void
+bfreetree(uint dev, uint addr, int level)
+{
+  int j;
+  struct buf *bp;
+  uint *a;
+
+  if(level > 0){
+    bp = bread(dev, addr);
+    a = (uint*)bp->data;
+    for(j = 0; j < NINDIRECT; j++){
+      if(a[j])
+        bfreetree(dev, a[j], level-1);
+    }
+    brelse(bp);
   }
+  bfree(dev, addr);
+}
 
-  panic("bmap: out of range");
+// Free the blocks of IF_EXTENT inode ip.
+static void
+itruncext(struct inode *ip)
+{
+  struct extent *e;
+  struct buf *bp;
+  int i;
+  uint b;
+
+  e = (struct extent*)ip->addrs;
+  for(i = 0; i < NIEXTENT; i++){
+    for(b = 0; b < e[i].len; b++)
+      bfree(ip->dev, e[i].start + b);
+    e[i].start = e[i].len = 0;
+  }
+  if(ip->addrs[NADDRS-1]){
+    bp = bread(ip->dev, ip->addrs[NADDRS-1]);
+    e = (struct extent*)bp->data;
+    for(i = 0; i < NBEXTENT; i++){
+      for(b = 0; b < e[i].len; b++)
+        bfree(ip->dev, e[i].start + b);
+    }
+    brelse(bp);
+    bfree(ip->dev, ip->addrs[NADDRS-1]);
+    ip->addrs[NADDRS-1] = 0;
+  }
 }
 
 // Truncate inode (discard contents).
@@ -425,9 +972,16 @@ bmap(struct inode *ip, uint bn)
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
+
+  textinval(ip);
+
+  if(ip->flags & IF_EXTENT){
+    itruncext(ip);
+    ip->size = 0;
+    iupdate(ip);
+    return;
+  }
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -436,16 +990,11 @@ itrunc(struct inode *ip)
     }
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  for(i = 0; i < NLEVEL; i++){
+    if(ip->addrs[NDIRECT+i]){
+      bfreetree(ip->dev, ip->addrs[NDIRECT+i], i+1);
+      ip->addrs[NDIRECT+i] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
 
   ip->size = 0;
@@ -464,8 +1013,52 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
-// Read data from inode.
+// Sequential read-ahead. readi() calls this for each block bn
+// of ip that it reads. If ip is being read sequentially, start
+// reading the next NREADAHEAD blocks into the buffer cache, so
+// they are there (or on their way) when the reader gets to them.
 // Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint b, end, addr, start, n;
+
+  if(bn != ip->nextbn && bn + 1 != ip->nextbn){
+    // not sequential; start over from here.
+    ip->nextbn = bn + 1;
+    ip->rabn = bn + 1;
+    return;
+  }
+  ip->nextbn = bn + 1;
+
+  // wait until at most half the window is left, so that
+  // read-ahead goes to the disk in runs of several blocks.
+  if(ip->rabn > bn + 1 + NREADAHEAD/2)
+    return;
+
+  end = min(bn + 1 + NREADAHEAD, (ip->size + BSIZE - 1) / BSIZE);
+  b = ip->rabn > bn + 1 ? ip->rabn : bn + 1;
+  start = n = 0;
+  for(; b < end; b++){
+    if((addr = bmapx(ip, b, 0)) == 0)
+      break;
+    if(n > 0 && addr == start + n){
+      n++;
+      continue;
+    }
+    if(n > 0)
+      breadahead(ip->dev, start, n);
+    start = addr;
+    n = 1;
+  }
+  if(n > 0)
+    breadahead(ip->dev, start, n);
+  if(b > ip->rabn)
+    ip->rabn = b;
+}
+
+// Read data from inode.
+// Caller must hold ip->lock, perhaps only shared.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
 int
@@ -480,10 +1073,11 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    uint addr = bmap(ip, off/BSIZE);
+    uint addr = bmapx(ip, off/BSIZE, 0);
     if(addr == 0)
       break;
     bp = bread(ip->dev, addr);
+    readahead(ip, off/BSIZE);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
@@ -513,6 +1107,12 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  if(ip->type == T_FILE && __atomic_load_n(&ip->nexec, __ATOMIC_RELAXED) > 0)
+    return -1;  // a process is running it
+
+  if(ip->type == T_FILE)
+    textinval(ip);
+
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
@@ -546,6 +1146,105 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// A directory is a file holding an array of dirents, which
+// user programs such as ls read directly. The directories that
+// mkdir creates also have a hash index (IF_DIRHASH), so that
+// looking up a name needn't scan the whole directory. The index
+// lives in the directory's own blocks, from file block DIRIDX
+// on, beyond the blocks that readi() and writei() touch. It is
+// DIRNBUCKET buckets of one block each; a bucket is an array of
+// entries (tag << 16) | (slot + 1), where slot is the index of
+// a dirent whose name hashes to the bucket and tag is the top
+// half of the name's hash. Unused entries are 0. "." and ".."
+// are not indexed. If a bucket fills up, the directory drops
+// IF_DIRHASH and falls back to linear scans.
+
+static uint
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261;  // FNV-1a
+  for(i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+static int
+isdots(char *name)
+{
+  return namecmp(name, ".") == 0 || namecmp(name, "..") == 0;
+}
+
+// Look for name in directory dp's hash index. If found, set
+// *poff to byte offset of entry and return its inode number;
+// otherwise return 0.
+static uint
+dirindexlookup(struct inode *dp, char *name, uint *poff)
+{
+  uint h, addr, e, off, inum;
+  struct buf *bp;
+  struct dirent de;
+  uint *a;
+  int i;
+
+  h = dirhash(name);
+  if((addr = bmapx(dp, DIRIDX + h % DIRNBUCKET, 0)) == 0)
+    return 0;
+  bp = bread(dp->dev, addr);
+  a = (uint*)bp->data;
+  inum = 0;
+  for(i = 0; i < NINDIRECT && inum == 0; i++){
+    e = a[i];
+    if(e == 0 || (e >> 16) != (h >> 16))
+      continue;
+    off = ((e & 0xffff) - 1) * sizeof(de);
+    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+      panic("dirindexlookup read");
+    if(de.inum != 0 && namecmp(name, de.name) == 0){
+      *poff = off;
+      inum = de.inum;
+    }
+  }
+  brelse(bp);
+  return inum;
+}
+
+// Add (if add is set) or remove the index entry for name,
+// whose dirent is at byte offset off, in directory dp.
+// If that fails, stop using dp's index.
+static void
+dirindex(struct inode *dp, char *name, uint off, int add)
+{
+  uint h, addr, e;
+  struct buf *bp;
+  uint *a;
+  int i;
+
+  h = dirhash(name);
+  e = (h >> 16) << 16 | (off / sizeof(struct dirent) + 1);
+  if((addr = bmapx(dp, DIRIDX + h % DIRNBUCKET, add)) != 0){
+    bp = bread(dp->dev, addr);
+    a = (uint*)bp->data;
+    for(i = 0; i < NINDIRECT; i++){
+      if(a[i] == (add ? 0 : e)){
+        a[i] = add ? e : 0;
+        log_write(bp);
+        brelse(bp);
+        return;
+      }
+    }
+    brelse(bp);
+  }
+
+  // bucket full, out of blocks, or entry missing.
+  dp->flags &= ~IF_DIRHASH;
+  iupdate(dp);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
@@ -557,6 +1256,16 @@ dirlookup(struct inode *dp, char *name, uint *poff)
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if((dp->flags & IF_DIRHASH) && !isdots(name)){
+    inum = dirindexlookup(dp, name, &off);
+    dcacheset(dp, name, inum);
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -567,10 +1276,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcacheset(dp, name, inum);
       return iget(dp->dev, inum);
     }
   }
 
+  dcacheset(dp, name, 0);
   return 0;
 }
 
@@ -589,22 +1300,48 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
+  // Look for an empty dirent. All the ones before
+  // dp->dirhint are in use.
+  for(off = dp->dirhint; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlink read");
     if(de.inum == 0)
       break;
   }
+  if((dp->flags & IF_DIRHASH) && off + sizeof(de) > DIRMAX)
+    return -1;
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     return -1;
+  dp->dirhint = off + sizeof(de);
+  dcacheset(dp, name, inum);
+
+  if((dp->flags & IF_DIRHASH) && !isdots(name))
+    dirindex(dp, name, off, 1);
 
   return 0;
 }
 
+// Remove the directory entry for name, at byte offset off,
+// from directory dp.
+void
+dirunlink(struct inode *dp, char *name, uint off)
+{
+  struct dirent de;
+
+  memset(&de, 0, sizeof(de));
+  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+    panic("dirunlink: writei");
+  if(off < dp->dirhint)
+    dp->dirhint = off;
+  dcacheset(dp, name, 0);
+
+  if(dp->flags & IF_DIRHASH)
+    dirindex(dp, name, off, 0);
+}
+
 // Paths
 
 // Copy the next path element from path into name.
@@ -659,6 +1396,16 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    // Only directories have dcache entries, so a hit
+    // also means ip is a directory.
+    if(!(nameiparent && *path == '\0') &&
+       dcachelookup(ip->dev, ip->inum, name, &next)){
+      iput(ip);
+      if(next == 0)
+        return 0;
+      ip = next;
+      continue;
+    }
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
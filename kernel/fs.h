@@ -24,9 +24,31 @@ struct superblock {
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+// addrs[] holds NDIRECT direct block addresses, then the
+// addresses of a singly-, a doubly- and a triply-indirect block.
+#define NDIRECT 9
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define NTINDIRECT (NDINDIRECT * NINDIRECT)
+#define NLEVEL 3    // levels of indirect blocks
+#define NADDRS (NDIRECT + NLEVEL)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT + NTINDIRECT)
+
+// Inode flags.
+#define IF_EXTENT 0x1  // addrs[] holds extents, see below
+#define IF_DIRHASH 0x2 // directory has a hash index, see fs.c
+
+// An extent maps len consecutive file blocks to the disk blocks
+// starting at start. In an IF_EXTENT inode, addrs[] holds
+// NIEXTENT extents, mapping the file's blocks in order, and
+// addrs[NADDRS-1] is the address of a block of NBEXTENT more.
+// Unused extents have len 0.
+struct extent {
+  uint start;
+  uint len;
+};
+#define NIEXTENT ((NADDRS - 1) / 2)
+#define NBEXTENT (BSIZE / sizeof(struct extent))
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +57,8 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint flags;           // IF_ flags
+  uint addrs[NADDRS];   // Data block addresses
 };
 
 // Inodes per block.
@@ -58,3 +81,8 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// Hash index of an IF_DIRHASH directory, see fs.c.
+#define DIRIDX (NDIRECT + NINDIRECT)  // file block of the first bucket
+#define DIRNBUCKET 128
+#define DIRMAX (DIRIDX * BSIZE)       // max size of an indexed directory
+
@@ -1,6 +1,19 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// Each hart keeps a small cache of free pages in kcpu[cpuid()],
+// so the common kalloc()/kfree() path only touches a lock that
+// no other hart normally wants. The caches refill from and drain
+// to the global kmem list KBATCH pages at a time. A hart whose
+// cache and the global list are both empty steals a batch from
+// another hart's cache.
+//
+// A page may be mapped by several page tables after a
+// copy-on-write fork(), so each page has a reference count;
+// kfree() only returns a page to the free lists once its last
+// reference has been dropped. When memory runs out, kalloc()
+// asks the text cache (textcache.c) to drop pages it alone holds.
 
 #include "types.h"
 #include "param.h"
@@ -14,19 +27,33 @@ void freerange(void *pa_start, void *pa_end);
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+#define KBATCH 32  // pages moved between a hart's cache and kmem at once
+
 struct run {
   struct run *next;
 };
 
-struct {
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;
+};
+
+struct kmem kmem;          // global pool
+struct kmem kcpu[NCPU];    // per-hart caches
+
+// Reference counts for physical pages, indexed by PA2REF(pa).
+// Updated with atomic instructions rather than under a lock,
+// so that harts sharing no pages do not contend.
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+int pageref[(PHYSTOP - KERNBASE) / PGSIZE];
 
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kcpu[i].lock, "kmem_cpu");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,31 +62,147 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    pageref[PA2REF(p)] = 1;
     kfree(p);
+  }
+}
+
+// Detach up to n pages from the front of km's free list.
+// Returns the chain (0-terminated) and sets *np to its length.
+// Never holds more than one kmem lock, so harts that refill,
+// drain and steal concurrently cannot deadlock.
+static struct run*
+ktake(struct kmem *km, int n, int *np)
+{
+  struct run *head, *last, *r;
+  int i;
+
+  acquire(&km->lock);
+  head = km->freelist;
+  last = 0;
+  for(i = 0, r = head; r && i < n; i++, r = r->next)
+    last = r;
+  if(last)
+    last->next = 0;
+  km->freelist = r;
+  km->nfree -= i;
+  release(&km->lock);
+
+  *np = i;
+  return i ? head : 0;
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
+// Push a chain of n pages onto km's free list.
+static void
+kput(struct kmem *km, struct run *head, int n)
+{
+  struct run *tail;
+
+  if(head == 0)
+    return;
+  for(tail = head; tail->next; tail = tail->next)
+    ;
+
+  acquire(&km->lock);
+  tail->next = km->freelist;
+  km->freelist = head;
+  km->nfree += n;
+  release(&km->lock);
+}
+
+// Refill this hart's empty cache, first from the global
+// pool, then by stealing from other harts.
+// Returns one page for the caller, or 0 if memory is exhausted.
+// Interrupts must be disabled.
+static struct run*
+krefill(int id)
+{
+  struct run *r;
+  int i, n;
+
+  r = ktake(&kmem, KBATCH, &n);
+  for(i = 1; r == 0 && i < NCPU; i++)
+    r = ktake(&kcpu[(id + i) % NCPU], KBATCH, &n);
+  if(r == 0)
+    return 0;
+
+  kput(&kcpu[id], r->next, n - 1);
+  return r;
+}
+
+// Add a reference to the page of physical memory pointed
+// at by pa, which must have been returned by kalloc().
+void
+krefinc(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krefinc");
+  if(__sync_fetch_and_add(&pageref[PA2REF(pa)], 1) < 1)
+    panic("krefinc: free page");
+}
+
+// Return the number of references to the page at pa.
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(&pageref[PA2REF(pa)], __ATOMIC_SEQ_CST);
+}
+
+// Return the number of free pages. Only a hint, since
+// other harts may allocate and free meanwhile.
+int
+kfreepages(void)
+{
+  int i, n;
+
+  n = __atomic_load_n(&kmem.nfree, __ATOMIC_RELAXED);
+  for(i = 0; i < NCPU; i++)
+    n += __atomic_load_n(&kcpu[i].nfree, __ATOMIC_RELAXED);
+  return n;
+}
+
+// Drop a reference to the page of physical memory pointed at
+// by pa, which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page is freed when no references remain.
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct kmem *km;
+  int drain, n, ref;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  ref = __sync_sub_and_fetch(&pageref[PA2REF(pa)], 1);
+  if(ref < 0)
+    panic("kfree: free page");
+  if(ref > 0)
+    return;
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  km = &kcpu[cpuid()];
+  acquire(&km->lock);
+  r->next = km->freelist;
+  km->freelist = r;
+  km->nfree++;
+  drain = km->nfree > 2*KBATCH;
+  release(&km->lock);
+
+  // Hand surplus pages back so other harts can use them.
+  if(drain){
+    r = ktake(km, KBATCH, &n);
+    kput(&kmem, r, n);
+  }
+  pop_off();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +212,30 @@ void *
 kalloc(void)
 {
   struct run *r;
+  struct kmem *km;
+  int id;
+
+  push_off();
+  id = cpuid();
+  km = &kcpu[id];
+  acquire(&km->lock);
+  r = km->freelist;
+  if(r){
+    km->freelist = r->next;
+    km->nfree--;
+  }
+  release(&km->lock);
+  if(r == 0)
+    r = krefill(id);
+  pop_off();
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  // Out of memory: give back cached text pages no one maps.
+  if(r == 0 && textreclaim() > 0)
+    return kalloc();
 
-  if(r)
+  if(r){
+    pageref[PA2REF(r)] = 1;
     memset((char*)r, 5, PGSIZE); // fill with junk
+  }
   return (void*)r;
 }
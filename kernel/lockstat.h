@@ -0,0 +1,7 @@
+// Contention statistics for the spinlocks and reader-writer
+// spinlocks with one name, as returned by lockstat().
+struct lockstat {
+  char name[16];     // Name of the locks.
+  uint64 nacquire;   // Times they were acquired.
+  uint64 nspin;      // Times acquire() went round its wait loop.
+};
@@ -10,8 +10,8 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. The logging system only closes a transaction when there
+// are no FS system calls active. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
@@ -19,107 +19,236 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the current transaction starts to commit.
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// It is double-buffered: the on-disk log is split into two
+// halves, and successive transactions alternate between them.
+// The format of each half:
+//   header block, containing a sequence number and
+//     block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+//
+// Commits are pipelined. commit() only keeps new FS system
+// calls out while it copies the closed transaction's blocks
+// into log buffers; after that, the next transaction
+// accumulates while the previous one is written to the log and
+// installed. Blocks are written with batched asynchronous I/O.
+//
+// If the new transaction modifies a block that the committing
+// one has yet to install, the install skips it and the old
+// transaction's header stays on disk until the new transaction
+// commits with the newer copy. Recovery replays the live halves
+// in sequence order. Installing never holds one home block's
+// buffer while waiting for another, since the FS system calls
+// running meanwhile lock buffers in their own order.
+
+// The size of the log comes from the superblock. Each half
+// holds at most LOGMAX blocks, as many as its header can list.
+#define LOGMAX ((BSIZE - 2*sizeof(int)) / sizeof(int))
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  uint seq;
+  int block[LOGMAX];
 };
 
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // blocks in the whole log; each half has size/2.
+  int cap;         // max blocks in a transaction.
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int committing;  // a commit() is in progress.
+  int copying;     // commit() is copying blocks; please wait.
+  int installing;  // install writes still in flight.
   int dev;
-  struct logheader lh;
+  struct logheader lh;  // the open transaction.
+  struct logheader clh; // the transaction commit() is committing.
+  struct buf *bufs[LOGMAX]; // commit()'s log or install buffers.
+  int half;        // which half of the log lh will commit to.
+  int live;        // half whose header must stay until the next commit, or -1.
+  uint seq;        // sequence number of the last commit.
 };
 struct log log;
 
+// the disk block number of block i of half h of the log.
+// block 0 is the header.
+#define LOGBLOCK(h, i) (log.start + (h)*(log.size/2) + (i))
+
 static void recover_from_log(void);
 static void commit();
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
+  if (sizeof(struct logheader) > BSIZE)
     panic("initlog: too big logheader");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  log.live = -1;
+
+  // a transaction must fit in half the log, and the cache must
+  // hold a committing transaction's pinned blocks and log
+  // buffers as well as the open transaction's pinned blocks.
+  log.cap = log.size/2 - 1;
+  if (log.cap > LOGMAX)
+    log.cap = LOGMAX;
+  if (log.cap > (bcachesize() - MAXOPBLOCKS) / 3)
+    log.cap = (bcachesize() - MAXOPBLOCKS) / 3;
+  if (log.cap < MAXOPBLOCKS)
+    panic("initlog: log too small");
   recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
+// Called by the disk interrupt when an install write is done.
 static void
-install_trans(int recovering)
+install_done(struct buf *b)
 {
-  int tail;
+  bunpin(b);
+  brelse_done(b);
+  acquire(&log.lock);
+  if(--log.installing == 0)
+    wakeup(&log.installing);
+  release(&log.lock);
+}
+
+// Copy committed blocks from half h of the log to their home
+// location, skipping blocks that the open transaction has
+// modified since. Return how many were skipped.
+//
+// While commit() installs, FS system calls of the open
+// transaction run and lock buffers in their own order, so
+// installing must not hold one home buffer while it waits
+// for another: the disk interrupt releases each one when its
+// write is done. Recovery runs alone and batches the writes.
+static int
+install_trans(int h, struct logheader *lh, int recovering)
+{
+  int tail, i, m, skipped;
+  struct buf **dbuf = log.bufs;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  if(recovering)
+    breadahead(log.dev, LOGBLOCK(h, 1), lh->n);
+  m = skipped = 0;
+  for (tail = 0; tail < lh->n; tail++) {
+    struct buf *b = bread(log.dev, lh->block[tail]); // read dst
+    if(recovering == 0){
+      // b is pinned, and still holds what the log holds, unless
+      // the open transaction has changed it; then it is the
+      // open transaction's to write.
+      acquire(&log.lock);
+      for (i = 0; i < log.lh.n; i++)
+        if (log.lh.block[i] == b->blockno)
+          break;
+      if (i < log.lh.n) {
+        release(&log.lock);
+        bunpin(b);
+        brelse(b);
+        skipped++;
+        continue;
+      }
+      log.installing++;
+      release(&log.lock);
+      bwrite_async(b, install_done);  // write dst to disk
+    } else {
+      struct buf *lbuf = bread(log.dev, LOGBLOCK(h, tail+1)); // read log block
+      memmove(b->data, lbuf->data, BSIZE);  // copy block to dst
+      brelse(lbuf);
+      dbuf[m++] = b;
+    }
+  }
+  if(recovering == 0){
+    acquire(&log.lock);
+    while(log.installing > 0)
+      sleep(&log.installing, &log.lock);
+    release(&log.lock);
+    return skipped;
+  }
+  bwritev_async(dbuf, m);  // write dsts to disk
+  for (i = 0; i < m; i++) {
+    bwait(dbuf[i]);
+    brelse(dbuf[i]);
   }
+  return skipped;
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the header of half h of the log from disk.
 static void
-read_head(void)
+read_head(int h, struct logheader *lh)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
+  struct buf *buf = bread(log.dev, LOGBLOCK(h, 0));
+  struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  lh->n = hb->n;
+  lh->seq = hb->seq;
+  if (lh->n < 0 || lh->n > LOGMAX || lh->n > log.size/2 - 1)
+    panic("read_head");
+  for (i = 0; i < lh->n; i++) {
+    lh->block[i] = hb->block[i];
   }
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write a header to half h of the log on disk.
+// Writing a header with n > 0 is the true point at which
+// a transaction commits.
 static void
-write_head(void)
+write_head(int h, struct logheader *lh)
 {
-  struct buf *buf = bread(log.dev, log.start);
+  struct buf *buf = bread(log.dev, LOGBLOCK(h, 0));
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = lh->n;
+  hb->seq = lh->seq;
+  for (i = 0; i < lh->n; i++) {
+    hb->block[i] = lh->block[i];
   }
   bwrite(buf);
   brelse(buf);
 }
 
+// Mark half h of the log empty on disk.
+static void
+erase_head(int h)
+{
+  struct buf *buf = bread(log.dev, LOGBLOCK(h, 0));
+  struct logheader *hb = (struct logheader *) (buf->data);
+  hb->n = 0;
+  hb->seq = 0;
+  bwrite(buf);
+  brelse(buf);
+}
+
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
+  struct logheader *lh[2] = { &log.lh, &log.clh };
+  int h, first;
+
+  read_head(0, lh[0]);
+  read_head(1, lh[1]);
+
+  // replay committed halves, older first.
+  first = (lh[0]->n > 0 && lh[1]->n > 0 && lh[1]->seq < lh[0]->seq) ? 1 : 0;
+  for (h = first; h < first + 2; h++) {
+    if (lh[h%2]->n > 0)
+      install_trans(h%2, lh[h%2], 1); // if committed, copy from log to disk
+    if (lh[h%2]->seq > log.seq)
+      log.seq = lh[h%2]->seq;
+  }
+  erase_head(first);  // clear the log
+  erase_head(1-first);
   log.lh.n = 0;
-  write_head(); // clear the log
+  log.half = 0;
 }
 
 // called at the start of each FS system call.
@@ -128,9 +257,9 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.copying){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > log.cap){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
@@ -142,7 +271,9 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation
+// and no commit is already in progress; otherwise
+// the commit in progress will pick this transaction up.
 void
 end_op(void)
 {
@@ -150,9 +281,9 @@ end_op(void)
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
+  if(log.copying)
+    panic("log.copying");
+  if(log.outstanding == 0 && !log.committing){
     do_commit = 1;
     log.committing = 1;
   } else {
@@ -167,39 +298,75 @@ end_op(void)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy modified blocks from cache to half h of the log, and
+// start writing them. Returns once the copies are made; the
+// caller waits for the writes.
 static void
-write_log(void)
+write_log(int h, struct logheader *lh, struct buf **to)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+  for (tail = 0; tail < lh->n; tail++) {
+    to[tail] = bread(log.dev, LOGBLOCK(h, tail+1)); // log block
+    struct buf *from = bread(log.dev, lh->block[tail]); // cache block
+    memmove(to[tail]->data, from->data, BSIZE);
     brelse(from);
-    brelse(to);
   }
+  bwritev_async(to, lh->n);  // write the log, as one request
 }
 
+// Commit closed transactions until there are none.
+// Caller has set log.committing.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+  struct logheader *lh = &log.clh;
+  struct buf **to = log.bufs;
+  int h, tail;
+
+  acquire(&log.lock);
+  while (log.outstanding == 0 && log.lh.n > 0) {
+    // close the open transaction, and keep new ones out
+    // until its blocks are copied.
+    *lh = log.lh;
+    lh->seq = ++log.seq;
+    h = log.half;
+    log.half = 1 - h;
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    log.copying = 1;
+    release(&log.lock);
+
+    write_log(h, lh, to);  // Copy modified blocks from cache to log
+
+    acquire(&log.lock);
+    log.copying = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    for (tail = 0; tail < lh->n; tail++) {
+      bwait(to[tail]);
+      brelse(to[tail]);
+    }
+    write_head(h, lh);    // Write header to disk -- the real commit
+    if (log.live >= 0) {
+      // this commit has the newer copies of the blocks that
+      // the previous one did not install.
+      erase_head(log.live);
+      log.live = -1;
+    }
+    if (install_trans(h, lh, 0) == 0) // Now install writes to home locations
+      erase_head(h);    // Erase the transaction from the log
+    else
+      log.live = h;
+
+    acquire(&log.lock);
   }
+  log.committing = 0;
+  wakeup(&log);
+  release(&log.lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -217,7 +384,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.cap)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -233,4 +400,3 @@ log_write(struct buf *b)
   }
   release(&log.lock);
 }
-
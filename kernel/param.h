@@ -1,13 +1,24 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
+#define NPRIO         3  // scheduling priority levels, 0 highest
+#define QUANTA  {1, 2, 4}  // ticks a process may run at each level
+#define BOOSTTICKS   50  // ticks between raising all processes to level 0
+#define TICKTIME 1000000  // time CSR counts between ticks; about 1/10th second in qemu
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // min size of in-memory i-node table
+#define NINODEMAX  8192  // max size of in-memory i-node table
+#define NDENTRY     512  // size of directory-entry cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define NSEG          4  // max loadable segments per program
+#define NTEXT       256  // max cached shared program text pages
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define LOGSIZE      (MAXOPBLOCKS*10)  // data blocks per log half made by mkfs
+#define NBUF         (LOGSIZE*3+MAXOPBLOCKS)  // min size of disk block cache
+#define NBUFMAX      4096  // max size of disk block cache
+#define FSSIZE       200000  // size of file system in blocks
+#define NREADAHEAD   8   // blocks read ahead of a sequential reader
+#define MAXIOBLOCKS  16  // max blocks in one disk request
 #define MAXPATH      128   // maximum file path name
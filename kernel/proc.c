@@ -12,6 +12,43 @@ struct proc proc[NPROC];
 
 struct proc *initproc;
 
+// Each CPU has a queue of RUNNABLE processes, which the
+// scheduler() on that CPU takes from in FIFO order; an idle CPU
+// steals from the others' queues. A process that becomes
+// RUNNABLE goes on the queue of the CPU it last ran on.
+//
+// Scheduling is a multi-level feedback queue: each run queue
+// has NPRIO levels, and scheduler() takes from the highest
+// non-empty one. A process may run for quantum[prio] ticks at
+// a level, over any number of turns, before it moves down a
+// level. Every BOOSTTICKS ticks, all processes go back up to
+// their base level (normally 0), so none starve; this happens
+// lazily, as each process and run queue is next looked at.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  uint boost;             // boost period levels were last merged in
+};
+
+struct runq runq[NCPU];
+
+static int quantum[NPRIO] = QUANTA;
+
+// Processes in sleep() are kept in a hash table of wait
+// queues, by channel, so that wakeup() only looks at those
+// sleeping on its channel. A wait queue's lock must be
+// acquired before any p->lock.
+#define NWAITQ 61
+#define WAITQ(chan) (&waitq[((uint64)(chan) >> 3) % NWAITQ])
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+};
+
+struct waitq waitq[NWAITQ];
+
 int nextpid = 1;
 struct spinlock pid_lock;
 
@@ -51,6 +88,10 @@ procinit(void)
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
@@ -102,6 +143,132 @@ allocpid()
   return pid;
 }
 
+// Interrupt CPU id, to wake it from wfi.
+static void
+ipi(int id)
+{
+  *(uint32*)CLINT_MSIP(id) = 1;
+}
+
+// Make sure a CPU will see that runq[id] has a new process:
+// wake CPU id if it is idle, or else some other idle CPU,
+// which will steal the process.
+static void
+kick(int id)
+{
+  int i;
+
+  __sync_synchronize();
+  if(__atomic_load_n(&cpus[id].idle, __ATOMIC_RELAXED)){
+    ipi(id);
+    return;
+  }
+  for(i = 0; i < NCPU; i++){
+    if(i != cpuid() && __atomic_load_n(&cpus[i].idle, __ATOMIC_RELAXED)){
+      ipi(i);
+      return;
+    }
+  }
+}
+
+// Does run queue rq hold a process of level less than prio?
+static int
+runqhas(struct runq *rq, int prio)
+{
+  for(int i = 0; i < prio; i++)
+    if(__atomic_load_n(&rq->head[i], __ATOMIC_RELAXED))
+      return 1;
+  return 0;
+}
+
+// Is every run queue empty?
+static int
+runqempty(void)
+{
+  for(int i = 0; i < NCPU; i++)
+    if(runqhas(&runq[i], NPRIO))
+      return 0;
+  return 1;
+}
+
+static uint
+boostperiod(void)
+{
+  return __atomic_load_n(&ticks, __ATOMIC_RELAXED) / BOOSTTICKS;
+}
+
+// Apply any boost since p was last looked at.
+// Caller must hold p->lock.
+static void
+boost(struct proc *p)
+{
+  uint b = boostperiod();
+
+  if(p->boost != b){
+    p->boost = b;
+    p->prio = p->baseprio;
+    p->slice = 0;
+  }
+}
+
+// Mark p RUNNABLE and append it to its CPU's run queue,
+// at its level. Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *rq = &runq[p->cpu];
+
+  boost(p);
+  p->state = RUNNABLE;
+  acquire(&rq->lock);
+  p->rqnext = 0;
+  if(rq->tail[p->prio])
+    rq->tail[p->prio]->rqnext = p;
+  else
+    rq->head[p->prio] = p;
+  rq->tail[p->prio] = p;
+  release(&rq->lock);
+  kick(p->cpu);
+}
+
+// Take the first process at the highest level of run
+// queue rq, or return 0 if rq is empty.
+static struct proc*
+dequeue(struct runq *rq)
+{
+  struct proc *p;
+  uint b;
+  int i;
+
+  acquire(&rq->lock);
+  // after a boost, the processes at every level are
+  // at level 0 (or their base level) again.
+  if(rq->boost != (b = boostperiod())){
+    rq->boost = b;
+    for(i = 1; i < NPRIO; i++){
+      if(rq->head[i] == 0)
+        continue;
+      if(rq->tail[0])
+        rq->tail[0]->rqnext = rq->head[i];
+      else
+        rq->head[0] = rq->head[i];
+      rq->tail[0] = rq->tail[i];
+      rq->head[i] = rq->tail[i] = 0;
+    }
+  }
+
+  p = 0;
+  for(i = 0; i < NPRIO && p == 0; i++){
+    if((p = rq->head[i]) != 0){
+      rq->head[i] = p->rqnext;
+      if(rq->head[i] == 0)
+        rq->tail[i] = 0;
+    }
+  }
+  release(&rq->lock);
+  return p;
+}
+
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
 // and return with p->lock held.
@@ -124,6 +291,9 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->prio = p->baseprio = 0;
+  p->slice = 0;
+  p->boost = boostperiod();
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -164,6 +334,8 @@ freeproc(struct proc *p)
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
+  p->children = 0;
+  p->sibling = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
@@ -249,7 +421,7 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
@@ -264,11 +436,23 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    // only reserve the address space; usertrap() allocates
+    // zeroed pages as the process first touches them.
+    if(sz + n < sz || sz + n > TRAPFRAME)
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
+    // pages given back must not reappear from the executable.
+    uint64 end = PGROUNDUP(sz);
+    for(struct vmseg *s = p->seg; s < &p->seg[NSEG]; s++){
+      if(s->va >= end)
+        s->memsz = 0;
+      else if(s->va + s->memsz > end)
+        s->memsz = end - s->va;
+      if(s->filesz > s->memsz)
+        s->filesz = s->memsz;
+    }
   }
   p->sz = sz;
   return 0;
@@ -307,6 +491,11 @@ fork(void)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  if(p->exe){
+    np->exe = idup(p->exe);
+    iexec(np->exe);
+  }
+  memmove(np->seg, p->seg, sizeof(p->seg));
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -316,10 +505,14 @@ fork(void)
 
   acquire(&wait_lock);
   np->parent = p;
+  np->sibling = p->children;
+  p->children = np;
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  np->cpu = p->cpu;
+  np->prio = np->baseprio = p->baseprio;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
@@ -332,12 +525,17 @@ reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    if(pp->parent == p){
-      pp->parent = initproc;
-      wakeup(initproc);
-    }
+  if(p->children == 0)
+    return;
+  for(pp = p->children; ; pp = pp->sibling){
+    pp->parent = initproc;
+    if(pp->sibling == 0)
+      break;
   }
+  pp->sibling = initproc->children;
+  initproc->children = p->children;
+  p->children = 0;
+  wakeup(initproc);
 }
 
 // Exit the current process.  Does not return.
@@ -360,10 +558,16 @@ exit(int status)
     }
   }
 
+  if(p->exe)
+    iunexec(p->exe);
   begin_op();
   iput(p->cwd);
+  if(p->exe)
+    iput(p->exe);
   end_op();
   p->cwd = 0;
+  p->exe = 0;
+  memset(p->seg, 0, sizeof(p->seg));
 
   acquire(&wait_lock);
 
@@ -390,41 +594,38 @@ exit(int status)
 int
 wait(uint64 addr)
 {
-  struct proc *pp;
-  int havekids, pid;
+  struct proc *pp, **link;
+  int pid;
   struct proc *p = myproc();
 
   acquire(&wait_lock);
 
   for(;;){
-    // Scan through table looking for exited children.
-    havekids = 0;
-    for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&pp->lock);
-
-        havekids = 1;
-        if(pp->state == ZOMBIE){
-          // Found one.
-          pid = pp->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
-            release(&pp->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(pp);
+    // Scan through our children looking for exited ones.
+    for(link = &p->children; (pp = *link) != 0; link = &pp->sibling){
+      // make sure the child isn't still in exit() or swtch().
+      acquire(&pp->lock);
+
+      if(pp->state == ZOMBIE){
+        // Found one.
+        pid = pp->pid;
+        if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
+                                sizeof(pp->xstate)) < 0) {
           release(&pp->lock);
           release(&wait_lock);
-          return pid;
+          return -1;
         }
+        *link = pp->sibling;
+        freeproc(pp);
         release(&pp->lock);
+        release(&wait_lock);
+        return pid;
       }
+      release(&pp->lock);
     }
 
     // No point waiting if we don't have any children.
-    if(!havekids || killed(p)){
+    if(p->children == 0 || killed(p)){
       release(&wait_lock);
       return -1;
     }
@@ -434,10 +635,36 @@ wait(uint64 addr)
   }
 }
 
+// Wait in wfi for a process to become RUNNABLE. CPU 0
+// keeps taking timer interrupts, to maintain ticks; the
+// others stop their timers while idle.
+static void
+idle(struct cpu *c, int id)
+{
+  // with interrupts off, an IPI that kick() sends after
+  // seeing c->idle set stays pending, and wfi returns at once.
+  intr_off();
+  __atomic_store_n(&c->idle, 1, __ATOMIC_RELAXED);
+  // pairs with the fence in kick(): either kick() sees
+  // c->idle set, or runqempty() sees the new process.
+  __sync_synchronize();
+  if(runqempty()){
+    if(id != 0)
+      timeridle(1);
+    asm volatile("wfi");
+    if(id != 0)
+      timeridle(0);
+  }
+  __atomic_store_n(&c->idle, 0, __ATOMIC_RELAXED);
+  intr_on();
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - choose a process to run: the head of this CPU's
+//    run queue, or else one stolen from another CPU's.
+//    if there is none, sleep in wfi until there is.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -446,6 +673,8 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
+  int i;
 
   c->proc = 0;
   for(;;){
@@ -454,22 +683,34 @@ scheduler(void)
     // processes are waiting.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+    p = dequeue(&runq[id]);
+    for(i = 1; p == 0 && i < NCPU; i++)
+      p = dequeue(&runq[(id + i) % NCPU]);
+    if(p == 0){
+      idle(c, id);
+      continue;
     }
+
+    // p may still be on its way into sched() on another
+    // CPU; acquiring p->lock waits for it to get there.
+    acquire(&p->lock);
+    if(p->state == RUNNABLE) {
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      p->state = RUNNING;
+      p->cpu = id;
+      boost(p);
+      if(p->slice <= 0)
+        p->slice = quantum[p->prio];
+      c->proc = p;
+      swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      c->proc = 0;
+    }
+    release(&p->lock);
   }
 }
 
@@ -506,11 +747,57 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
 
+// Called on each timer interrupt while the current process
+// is running: charge it for the tick, and give up the CPU if
+// it has used up its time at this level, which moves it down
+// a level, or if a process of a higher level is waiting.
+void
+preempt(void)
+{
+  struct proc *p = myproc();
+
+  acquire(&p->lock);
+  boost(p);
+  if(--p->slice <= 0){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->slice = 0;
+  }
+  if(p->slice == 0 || runqhas(&runq[p->cpu], p->prio)){
+    setrunnable(p);
+    sched();
+  }
+  release(&p->lock);
+}
+
+// Set the base level of the process with the given pid,
+// and move it to that level.
+int
+setpriority(int pid, int prio)
+{
+  struct proc *p;
+
+  if(prio < 0 || prio >= NPRIO)
+    return -1;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED && p->state != ZOMBIE){
+      p->baseprio = prio;
+      p->prio = prio;
+      p->slice = 0;
+      release(&p->lock);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch to forkret.
 void
@@ -541,28 +828,44 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct waitq *wq = WAITQ(chan);
+  struct proc **pp;
   
-  // Must acquire p->lock in order to
-  // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold wq->lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks wq->lock),
   // so it's okay to release lk.
 
-  acquire(&p->lock);  //DOC: sleeplock1
+  acquire(&wq->lock);  //DOC: sleeplock1
   release(lk);
 
-  // Go to sleep.
+  // Go to sleep. Must acquire p->lock in order to
+  // change p->state and then call sched. A wakeup()
+  // that finds p on wq waits for p->lock, which
+  // sched() hands on to the scheduler.
   p->chan = chan;
+  p->wqnext = wq->head;
+  wq->head = p;
+  acquire(&p->lock);
   p->state = SLEEPING;
+  release(&wq->lock);
 
   sched();
 
-  // Tidy up.
-  p->chan = 0;
+  release(&p->lock);
+
+  // Tidy up. wakeup() takes p off wq, but kill()
+  // leaves it there.
+  acquire(&wq->lock);
+  if(p->chan){
+    for(pp = &wq->head; *pp != p; pp = &(*pp)->wqnext)
+      ;
+    *pp = p->wqnext;
+    p->chan = 0;
+  }
+  release(&wq->lock);
 
   // Reacquire original lock.
-  release(&p->lock);
   acquire(lk);
 }
 
@@ -571,17 +874,24 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  struct waitq *wq = WAITQ(chan);
+  struct proc *p, **pp;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
+  acquire(&wq->lock);
+  for(pp = &wq->head; (p = *pp) != 0; ){
+    if(p->chan != chan){
+      pp = &p->wqnext;
+      continue;
     }
+    *pp = p->wqnext;
+    p->chan = 0;
+    acquire(&p->lock);
+    if(p->state == SLEEPING) {
+      setrunnable(p);
+    }
+    release(&p->lock);
   }
+  release(&wq->lock);
 }
 
 // Kill the process with the given pid.
@@ -598,7 +908,7 @@ kill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        setrunnable(p);
       }
       release(&p->lock);
       return 0;
@@ -24,6 +24,7 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int idle;                   // Waiting in scheduler() for work?
 };
 
 extern struct cpu cpus[NCPU];
@@ -79,6 +80,17 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A program segment that exec() leaves in the executable
+// file; uvmfault() reads each page in on first access.
+// Pages from va+filesz to va+memsz are zero (bss).
+struct vmseg {
+  uint64 va;        // page-aligned start; memsz == 0 if slot unused
+  uint64 memsz;     // size in memory
+  uint64 off;       // offset of the segment in the file
+  uint64 filesz;    // bytes to read from the file
+  int perm;         // PTE_X and/or PTE_W
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -87,13 +99,26 @@ struct proc {
 
   // p->lock must be held when using these:
   enum procstate state;        // Process state
-  void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU whose run queue it goes on
+  int prio;                    // Scheduling level, 0 highest
+  int baseprio;                // Level after a boost, see setpriority()
+  int slice;                   // Ticks left to run at this level
+  uint boost;                  // Boost period prio was last reset in
+
+  // the run queue's lock must be held when using this:
+  struct proc *rqnext;         // Next process in run queue
+
+  // the wait queue's lock must be held when using these:
+  void *chan;                  // If non-zero, sleeping on chan
+  struct proc *wqnext;         // Next process in wait queue
 
-  // wait_lock must be held when using this:
+  // wait_lock must be held when using these:
   struct proc *parent;         // Parent process
+  struct proc *children;       // First child
+  struct proc *sibling;        // Next child of parent
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
@@ -103,5 +128,7 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct inode *exe;           // Executable that seg[] pages come from
+  struct vmseg seg[NSEG];      // Program segments not loaded by exec()
   char name[16];               // Process name (debugging)
 };
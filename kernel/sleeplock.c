@@ -51,5 +51,70 @@ holdingsleep(struct sleeplock *lk)
   return r;
 }
 
+void
+initrwsleeplock(struct rwsleeplock *lk, char *name)
+{
+  initlock(&lk->lk, "rw sleep lock");
+  lk->name = name;
+  lk->readers = 0;
+  lk->writer = 0;
+  lk->wwait = 0;
+  lk->pid = 0;
+}
+
+void
+racquiresleep(struct rwsleeplock *lk)
+{
+  acquire(&lk->lk);
+  while (lk->writer || lk->wwait) {
+    sleep(lk, &lk->lk);
+  }
+  lk->readers++;
+  release(&lk->lk);
+}
 
+void
+rreleasesleep(struct rwsleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->readers < 1)
+    panic("rreleasesleep");
+  if(--lk->readers == 0)
+    wakeup(lk);
+  release(&lk->lk);
+}
 
+void
+wacquiresleep(struct rwsleeplock *lk)
+{
+  acquire(&lk->lk);
+  lk->wwait++;
+  while (lk->writer || lk->readers) {
+    sleep(lk, &lk->lk);
+  }
+  lk->wwait--;
+  lk->writer = 1;
+  lk->pid = myproc()->pid;
+  release(&lk->lk);
+}
+
+void
+wreleasesleep(struct rwsleeplock *lk)
+{
+  acquire(&lk->lk);
+  lk->writer = 0;
+  lk->pid = 0;
+  wakeup(lk);
+  release(&lk->lk);
+}
+
+int
+wholdingsleep(struct rwsleeplock *lk)
+{
+  int r;
+  
+  acquire(&lk->lk);
+  r = lk->writer && (lk->pid == myproc()->pid);
+  release(&lk->lk);
+  return r;
+}
@@ -8,3 +8,17 @@ struct sleeplock {
   int pid;           // Process holding lock
 };
 
+// Reader-writer sleep lock: any number of processes may
+// hold it to read, or one to write. A waiting writer keeps
+// new readers out.
+struct rwsleeplock {
+  struct spinlock lk; // spinlock protecting this sleep lock
+  int readers;       // Processes holding it to read.
+  int writer;        // Held to write?
+  int wwait;         // Writers waiting.
+
+  // For debugging:
+  char *name;        // Name of lock.
+  int pid;           // Process holding it to write
+};
+
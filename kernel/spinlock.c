@@ -6,14 +6,48 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "proc.h"
+#include "lockstat.h"
 #include "defs.h"
 
+// All initialized locks, for lockstat(), linked through
+// lk->nextlk. locks.lock itself isn't on the list.
+struct {
+  struct spinlock lock;
+  struct spinlock *head;
+  struct rwspinlock *rwhead;  // reader-writer locks
+} locks = { .lock = { .name = "locks" } };
+
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
-  lk->locked = 0;
+  lk->next = 0;
+  lk->owner = 0;
   lk->cpu = 0;
+  lk->nacquire = 0;
+  lk->nspin = 0;
+
+  acquire(&locks.lock);
+  lk->nextlk = locks.head;
+  locks.head = lk;
+  release(&locks.lock);
+}
+
+// Take lk off the list of locks, before freeing the
+// memory it is in.
+void
+freelock(struct spinlock *lk)
+{
+  struct spinlock **pp;
+
+  acquire(&locks.lock);
+  for(pp = &locks.head; *pp; pp = &(*pp)->nextlk){
+    if(*pp == lk){
+      *pp = lk->nextlk;
+      break;
+    }
+  }
+  release(&locks.lock);
 }
 
 // Acquire the lock.
@@ -21,16 +55,20 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  uint ticket;
+  uint64 spins;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
-  //   a5 = 1
-  //   s1 = &lk->locked
-  //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+  // Take a ticket and wait for it to come up.
+  // On RISC-V, the fetch-and-add turns into
+  //   amoadd.w a5, a5, (s1)
+  ticket = __atomic_fetch_add(&lk->next, 1, __ATOMIC_RELAXED);
+  spins = 0;
+  while(__atomic_load_n(&lk->owner, __ATOMIC_RELAXED) != ticket)
+    spins++;
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,6 +78,8 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+  lk->nacquire++;
+  lk->nspin += spins;
 }
 
 // Release the lock.
@@ -59,14 +99,11 @@ release(struct spinlock *lk)
   // On RISC-V, this emits a fence instruction.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code doesn't use a C assignment, since the C standard
-  // implies that an assignment might be implemented with
-  // multiple store instructions.
-  // On RISC-V, sync_lock_release turns into an atomic swap:
-  //   s1 = &lk->locked
-  //   amoswap.w zero, zero, (s1)
-  __sync_lock_release(&lk->locked);
+  // Hand the lock to the next ticket. This code doesn't use a
+  // C assignment, since the C standard implies that an
+  // assignment might be implemented with multiple store
+  // instructions.
+  __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELAXED);
 
   pop_off();
 }
@@ -77,10 +114,146 @@ int
 holding(struct spinlock *lk)
 {
   int r;
-  r = (lk->locked && lk->cpu == mycpu());
+  r = (lk->next != lk->owner && lk->cpu == mycpu());
   return r;
 }
 
+// Add one lock's statistics to the entry for its name among
+// the *nls entries of ls[0..n-1], starting a new entry if there
+// is room.
+static void
+lockstatadd(struct lockstat *ls, int n, int *nls, char *name,
+            uint64 nacquire, uint64 nspin)
+{
+  int i;
+
+  for(i = 0; i < *nls; i++)
+    if(strncmp(ls[i].name, name, sizeof(ls[i].name)) == 0)
+      break;
+  if(i == *nls){
+    if(*nls == n)
+      return;
+    safestrcpy(ls[i].name, name, sizeof(ls[i].name));
+    ls[i].nacquire = 0;
+    ls[i].nspin = 0;
+    (*nls)++;
+  }
+  ls[i].nacquire += nacquire;
+  ls[i].nspin += nspin;
+}
+
+// Sum the statistics of the locks with each name into
+// ls[0..n-1]. Returns the number of names filled in.
+int
+lockstat(struct lockstat *ls, int n)
+{
+  struct spinlock *lk;
+  struct rwspinlock *rw;
+  int nls;
+
+  nls = 0;
+  acquire(&locks.lock);
+  for(lk = locks.head; lk; lk = lk->nextlk)
+    lockstatadd(ls, n, &nls, lk->name, lk->nacquire, lk->nspin);
+  for(rw = locks.rwhead; rw; rw = rw->nextlk)
+    lockstatadd(ls, n, &nls, rw->name,
+                __atomic_load_n(&rw->nacquire, __ATOMIC_RELAXED),
+                __atomic_load_n(&rw->nspin, __ATOMIC_RELAXED));
+  release(&locks.lock);
+  return nls;
+}
+
+#define RW_WRITER  0x80000000  // held by a writer
+#define RW_WAITING 0x40000000  // a writer is waiting
+
+void
+initrwlock(struct rwspinlock *rw, char *name)
+{
+  rw->name = name;
+  rw->state = 0;
+  rw->cpu = 0;
+  rw->nacquire = 0;
+  rw->nspin = 0;
+
+  acquire(&locks.lock);
+  rw->nextlk = locks.rwhead;
+  locks.rwhead = rw;
+  release(&locks.lock);
+}
+
+// Acquire rw to read, alongside any other readers.
+void
+racquire(struct rwspinlock *rw)
+{
+  uint s;
+  uint64 spins;
+
+  push_off(); // disable interrupts to avoid deadlock.
+  for(spins = 0; ; spins++){
+    s = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+    if((s & (RW_WRITER|RW_WAITING)) == 0 &&
+       __atomic_compare_exchange_n(&rw->state, &s, s + 1, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+  __atomic_fetch_add(&rw->nacquire, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&rw->nspin, spins, __ATOMIC_RELAXED);
+}
+
+void
+rrelease(struct rwspinlock *rw)
+{
+  if((rw->state & ~(RW_WRITER|RW_WAITING)) == 0)
+    panic("rrelease");
+  __atomic_fetch_sub(&rw->state, 1, __ATOMIC_RELEASE);
+  pop_off();
+}
+
+// Acquire rw to write, excluding everyone else.
+void
+wacquire(struct rwspinlock *rw)
+{
+  uint s;
+  uint64 spins;
+
+  push_off(); // disable interrupts to avoid deadlock.
+  if(wholding(rw))
+    panic("wacquire");
+  for(spins = 0; ; spins++){
+    s = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+    if((s & ~RW_WAITING) == 0){
+      if(__atomic_compare_exchange_n(&rw->state, &s, RW_WRITER, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        break;
+    } else if((s & RW_WAITING) == 0){
+      // keep new readers out until we get it.
+      __atomic_compare_exchange_n(&rw->state, &s, s | RW_WAITING, 0,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+  }
+  rw->cpu = mycpu();
+  __atomic_fetch_add(&rw->nacquire, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&rw->nspin, spins, __ATOMIC_RELAXED);
+}
+
+void
+wrelease(struct rwspinlock *rw)
+{
+  if(!wholding(rw))
+    panic("wrelease");
+  rw->cpu = 0;
+  __atomic_fetch_and(&rw->state, ~RW_WRITER, __ATOMIC_RELEASE);
+  pop_off();
+}
+
+// Check whether this cpu holds rw to write.
+// Interrupts must be off.
+int
+wholding(struct rwspinlock *rw)
+{
+  return (rw->state & RW_WRITER) && rw->cpu == mycpu();
+}
+
 // push_off/pop_off are like intr_off()/intr_on() except that they are matched:
 // it takes two pop_off()s to undo two push_off()s.  Also, if interrupts
 // are initially off, then push_off, pop_off leaves them off.
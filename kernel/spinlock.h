@@ -1,9 +1,32 @@
-// Mutual exclusion lock.
+// Mutual exclusion lock: a ticket lock, so that waiting
+// CPUs get the lock in the order they asked for it.
 struct spinlock {
-  uint locked;       // Is the lock held?
+  uint next;         // Next ticket to hand out.
+  uint owner;        // Ticket now holding the lock.
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
+
+  // For lockstat(); protected by the lock itself.
+  uint64 nacquire;   // Times acquired.
+  uint64 nspin;      // Times round the wait loop in acquire().
+  struct spinlock *nextlk; // List of all locks, see initlock().
+};
+
+// Reader-writer spin lock: any number of CPUs may hold it
+// to read, or one to write. A waiting writer keeps new
+// readers out.
+struct rwspinlock {
+  uint state;        // RW_WRITER, RW_WAITING, and count of readers.
+
+  // For debugging:
+  char *name;        // Name of lock.
+  struct cpu *cpu;   // The cpu holding the lock to write.
+
+  // For lockstat(); updated atomically, since readers share it.
+  uint64 nacquire;   // Times acquired, to read or write.
+  uint64 nspin;      // Times round the wait loops.
+  struct rwspinlock *nextlk; // List of all rw locks, see initrwlock().
 };
 
@@ -76,6 +76,8 @@ sys_read(void)
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
+  if(n > 0 && uvmprefault(p, n) < 0)
+    return -1;
   return fileread(f, p, n);
 }
 
@@ -90,6 +92,8 @@ sys_write(void)
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
+  if(n > 0 && uvmprefault(p, n) < 0)
+    return -1;
 
   return filewrite(f, p, n);
 }
@@ -189,7 +193,6 @@ uint64
 sys_unlink(void)
 {
   struct inode *ip, *dp;
-  struct dirent de;
   char name[DIRSIZ], path[MAXPATH];
   uint off;
 
@@ -219,9 +222,7 @@ sys_unlink(void)
     goto bad;
   }
 
-  memset(&de, 0, sizeof(de));
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-    panic("unlink: writei");
+  dirunlink(dp, name, off);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -271,6 +272,8 @@ create(char *path, short type, short major, short minor)
   ip->major = major;
   ip->minor = minor;
   ip->nlink = 1;
+  if(type == T_DIR)
+    ip->flags |= IF_DIRHASH;
   iupdate(ip);
 
   if(type == T_DIR){  // Create . and .. entries.
@@ -335,12 +338,28 @@ sys_open(void)
     }
   }
 
+  if((omode & O_EXTENT) && ip->type == T_FILE && ip->size == 0 &&
+     (ip->flags & IF_EXTENT) == 0){
+    // switch the empty file to extents.
+    itrunc(ip);
+    ip->flags |= IF_EXTENT;
+    iupdate(ip);
+  }
+
   if(ip->type == T_DEVICE && (ip->major < 0 || ip->major >= NDEV)){
     iunlockput(ip);
     end_op();
     return -1;
   }
 
+  if(ip->type == T_FILE && (omode & (O_WRONLY|O_RDWR|O_TRUNC)) &&
+     __atomic_load_n(&ip->nexec, __ATOMIC_RELAXED) > 0){
+    // a process is running it; see iexec().
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+
   if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
     if(f)
       fileclose(f);
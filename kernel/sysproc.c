@@ -5,6 +5,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "lockstat.h"
 
 uint64
 sys_exit(void)
@@ -32,6 +33,8 @@ sys_wait(void)
 {
   uint64 p;
   argaddr(0, &p);
+  if(p != 0 && uvmprefault(p, sizeof(int)) < 0)
+    return -1;
   return wait(p);
 }
 
@@ -52,22 +55,11 @@ uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   argint(0, &n);
   if(n < 0)
     n = 0;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(killed(myproc())){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  return sleepuntil(r_time() + (uint64)n * TICKTIME);
 }
 
 uint64
@@ -91,3 +83,38 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+// set the scheduling level of a process.
+uint64
+sys_setpriority(void)
+{
+  int pid, prio;
+
+  argint(0, &pid);
+  argint(1, &prio);
+  return setpriority(pid, prio);
+}
+
+// copy contention statistics for up to n lock names
+// to user memory; returns how many were copied.
+uint64
+sys_lockstat(void)
+{
+  uint64 addr;
+  int n, nls;
+  struct lockstat *ls;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  if(n < 0)
+    return -1;
+  if(n > PGSIZE / sizeof(*ls))
+    n = PGSIZE / sizeof(*ls);
+  if((ls = (struct lockstat*)kalloc()) == 0)
+    return -1;
+  nls = lockstat(ls, n);
+  if(copyout(myproc()->pagetable, addr, (char*)ls, nls * sizeof(*ls)) < 0)
+    nls = -1;
+  kfree(ls);
+  return nls;
+}
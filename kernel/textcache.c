@@ -0,0 +1,204 @@
+// Shared program text.
+//
+// Every process running the same binary needs identical
+// read-only, executable pages. Rather than reading a private
+// copy for each process, uvmfault() asks textget() for the page,
+// and the text cache hands out one physical page, keyed by the
+// executable's (dev, inum) and the file range the page holds,
+// to all of them. Pages are reference counted (see kalloc.c);
+// the cache holds one reference of its own, so a page stays
+// cached after the last process using it exits.
+//
+// The cache is hashed on (dev, inum, offset). writei() and
+// itrunc() call textinval() before changing a file, so later
+// faults see the new contents; it only has work to do for
+// inodes that textget() has read. Processes that already
+// mapped a page keep the old one, just as if exec() had read
+// it eagerly.
+//
+// kalloc() calls textreclaim() when memory runs out, to free
+// cached pages that no process is using.
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "defs.h"
+
+#define NTEXTHASH 61
+#define THASH(dev, inum, off) \
+  (((dev) * 31 + (inum) * 17 + (off) / PGSIZE) % NTEXTHASH)
+
+struct textpage {
+  uint dev;
+  uint inum;
+  uint off;       // file offset of the page's contents
+  uint n;         // bytes read from the file; the rest is zero
+  void *pa;       // the page, or 0 if this slot is free
+  struct textpage *next;  // hash chain, or free list
+};
+
+struct {
+  struct spinlock lock;
+  struct textpage page[NTEXT];
+  struct textpage *hash[NTEXTHASH];
+  struct textpage *free;  // slots not in use
+  uint gen;       // bumped by every textinval() that drops pages
+} textcache;
+
+void
+textinit(void)
+{
+  struct textpage *t;
+
+  initlock(&textcache.lock, "textcache");
+  for(t = textcache.page; t < &textcache.page[NTEXT]; t++){
+    t->next = textcache.free;
+    textcache.free = t;
+  }
+}
+
+// Find a cached page. Caller must hold textcache.lock.
+static struct textpage*
+textlookup(uint dev, uint inum, uint off, uint n)
+{
+  struct textpage *t;
+
+  for(t = textcache.hash[THASH(dev, inum, off)]; t; t = t->next)
+    if(t->dev == dev && t->inum == inum && t->off == off && t->n == n)
+      return t;
+  return 0;
+}
+
+// Free slot t's page and put t on the free list.
+// Caller must hold textcache.lock.
+static void
+textdrop(struct textpage *t)
+{
+  struct textpage **pp;
+
+  for(pp = &textcache.hash[THASH(t->dev, t->inum, t->off)]; *pp != t; pp = &(*pp)->next)
+    ;
+  *pp = t->next;
+  kfree(t->pa);
+  t->pa = 0;
+  t->next = textcache.free;
+  textcache.free = t;
+}
+
+// Return a page holding n bytes of ip starting at off,
+// followed by zeros, with a reference for the caller.
+// ip must not be locked. Returns 0 if out of memory or
+// the file could not be read.
+void*
+textget(struct inode *ip, uint off, uint n)
+{
+  struct textpage *t, **bucket;
+  char *mem;
+  uint gen;
+  int r;
+
+  acquire(&textcache.lock);
+  if((t = textlookup(ip->dev, ip->inum, off, n)) != 0){
+    krefinc(t->pa);
+    release(&textcache.lock);
+    return t->pa;
+  }
+  gen = textcache.gen;
+  release(&textcache.lock);
+
+  // Mark ip before reading it, so that a write after the read
+  // calls textinval(), which changes gen.
+  __atomic_store_n(&ip->textcached, 1, __ATOMIC_SEQ_CST);
+
+  // Not cached; read it without holding the spinlock.
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  ilockshared(ip);
+  r = readi(ip, 0, (uint64)mem, off, n);
+  iunlockshared(ip);
+  if(r != n){
+    kfree(mem);
+    return 0;
+  }
+
+  acquire(&textcache.lock);
+  if((t = textlookup(ip->dev, ip->inum, off, n)) != 0){
+    // another process read it first; use that copy.
+    krefinc(t->pa);
+    release(&textcache.lock);
+    kfree(mem);
+    return t->pa;
+  }
+  if(gen != textcache.gen){
+    // a file may have changed since the read; don't cache it.
+    release(&textcache.lock);
+    return mem;
+  }
+
+  // Use a free slot, or recycle a page no process maps.
+  if(textcache.free == 0){
+    for(t = textcache.page; t < &textcache.page[NTEXT]; t++){
+      if(krefcnt(t->pa) == 1){
+        textdrop(t);
+        break;
+      }
+    }
+  }
+  if((t = textcache.free) != 0){
+    textcache.free = t->next;
+    t->dev = ip->dev;
+    t->inum = ip->inum;
+    t->off = off;
+    t->n = n;
+    t->pa = mem;
+    krefinc(mem);
+    bucket = &textcache.hash[THASH(ip->dev, ip->inum, off)];
+    t->next = *bucket;
+    *bucket = t;
+  }
+  release(&textcache.lock);
+  return mem;
+}
+
+// Forget all cached pages of ip, whose contents are about
+// to change, or whose table entry is being recycled. Only
+// inodes textget() has read from can have any.
+void
+textinval(struct inode *ip)
+{
+  struct textpage *t;
+
+  if(__atomic_load_n(&ip->textcached, __ATOMIC_SEQ_CST) == 0)
+    return;
+
+  acquire(&textcache.lock);
+  textcache.gen++;
+  for(t = textcache.page; t < &textcache.page[NTEXT]; t++)
+    if(t->pa && t->dev == ip->dev && t->inum == ip->inum)
+      textdrop(t);
+  release(&textcache.lock);
+}
+
+// Drop cached pages that no process has mapped.
+// Returns the number of pages freed.
+int
+textreclaim(void)
+{
+  struct textpage *t;
+  int freed = 0;
+
+  acquire(&textcache.lock);
+  for(t = textcache.page; t < &textcache.page[NTEXT]; t++){
+    if(t->pa && krefcnt(t->pa) == 1){
+      textdrop(t);
+      freed++;
+    }
+  }
+  release(&textcache.lock);
+  return freed;
+}
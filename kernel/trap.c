@@ -65,6 +65,9 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            uvmfault(p, r_stval(), r_scause() == 15) == 0){
+    // page fault on a not-yet-loaded or copy-on-write page.
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -76,9 +79,9 @@ usertrap(void)
   if(killed(p))
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
+  // maybe give up the CPU if this is a timer interrupt.
   if(which_dev == 2)
-    yield();
+    preempt();
 
   usertrapret();
 }
@@ -150,22 +153,112 @@ kerneltrap()
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
+  // maybe give up the CPU if this is a timer interrupt.
   if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
-    yield();
+    preempt();
 
-  // the yield() may have caused some traps to occur,
+  // the preempt() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
   w_sepc(sepc);
   w_sstatus(sstatus);
 }
 
+// Sleeping processes wait on timers, which are kept in a
+// hashed timer wheel of NWHEEL slots so that clockintr() only
+// looks at the timers that may go off on the current tick: a
+// timer to be checked on tick k is in slot k % NWHEEL.
+// Deadlines are values of the time CSR, which advances by
+// TICKTIME per tick, so a sleep lasts its full length however
+// close to a tick it starts. Timers only fire on ticks, though:
+// a sleeper wakes on the first tick at or after its deadline,
+// so sleep(n) lasts between n and n+1 ticks, and there is no
+// resolution finer than a tick. tickslock protects the wheel.
+#define NWHEEL 64
+
+struct timer {
+  uint64 deadline;      // time CSR value to wake at
+  uint tick;            // tick on which to check deadline
+  int fired;
+  struct timer *next;   // next in slot
+};
+
+static struct timer *wheel[NWHEEL];
+static uint64 ticktime; // time CSR at the last tick
+
+static void
+timeradd(struct timer *t)
+{
+  struct timer **slot = &wheel[t->tick % NWHEEL];
+
+  t->next = *slot;
+  *slot = t;
+}
+
+static void
+timerdel(struct timer *t)
+{
+  struct timer **pp;
+
+  for(pp = &wheel[t->tick % NWHEEL]; *pp != t; pp = &(*pp)->next)
+    ;
+  *pp = t->next;
+}
+
+// Sleep until the time CSR reaches deadline.
+// Returns -1 if the process is killed first.
+int
+sleepuntil(uint64 deadline)
+{
+  struct timer t;
+
+  acquire(&tickslock);
+  if(r_time() >= deadline){
+    release(&tickslock);
+    return 0;
+  }
+  // the first tick at or after the deadline.
+  t.tick = ticks + 1;
+  if(deadline > ticktime + TICKTIME)
+    t.tick = ticks + (deadline - ticktime + TICKTIME - 1) / TICKTIME;
+  t.deadline = deadline;
+  t.fired = 0;
+  timeradd(&t);
+  while(!t.fired){
+    if(killed(myproc())){
+      timerdel(&t);
+      release(&tickslock);
+      return -1;
+    }
+    sleep(&t, &tickslock);
+  }
+  release(&tickslock);
+  return 0;
+}
+
 void
 clockintr()
 {
+  struct timer *t, **pp;
+
   acquire(&tickslock);
   ticks++;
-  wakeup(&ticks);
+  ticktime = r_time();
+  for(pp = &wheel[ticks % NWHEEL]; (t = *pp) != 0; ){
+    if(t->tick != ticks){
+      // for a later time round the wheel.
+      pp = &t->next;
+      continue;
+    }
+    *pp = t->next;
+    if(t->deadline <= ticktime){
+      t->fired = 1;
+      wakeup(t);
+    } else {
+      // the tick came a little early.
+      t->tick++;
+      timeradd(t);
+    }
+  }
   release(&tickslock);
 }
 
@@ -202,17 +295,21 @@ devintr()
 
     return 1;
   } else if(scause == 0x8000000000000001L){
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer interrupt
+    // or IPI, forwarded by timervec in kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
 
+    // an IPI only needs to wake the CPU from wfi.
+    if(!timerticked())
+      return 1;
+
+    if(cpuid() == 0){
+      clockintr();
+    }
+
     return 2;
   } else {
     return 0;
@@ -45,9 +45,10 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
-// this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// at most this many virtio descriptors; virtio_disk_init()
+// uses fewer if the device's queue is shorter.
+// must be a power of two, and the descriptors must fit in a page.
+#define NUM 256
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -22,7 +22,7 @@
 static struct disk {
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
-  // disk operations. there are NUM descriptors.
+  // disk operations. there are num descriptors.
   // most commands consist of a "chain" (a linked list) of a couple of
   // these descriptors.
   struct virtq_desc *desc;
@@ -30,17 +30,18 @@ static struct disk {
   // a ring in which the driver writes descriptor numbers
   // that the driver would like the device to process.  it only
   // includes the head descriptor of each chain. the ring has
-  // NUM elements.
+  // num elements.
   struct virtq_avail *avail;
 
   // a ring in which the device writes descriptor numbers that
   // the device has finished processing (just the head of each chain).
-  // there are NUM used ring entries.
+  // there are num used ring entries.
   struct virtq_used *used;
 
   // our own book-keeping.
+  uint32 num;      // queue size agreed with the device, <= NUM
   char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  uint16 used_idx; // we've looked this far in used[2..num].
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
@@ -110,11 +111,15 @@ virtio_disk_init(void)
   if(*R(VIRTIO_MMIO_QUEUE_READY))
     panic("virtio disk should not be ready");
 
-  // check maximum queue size.
+  // check maximum queue size, and use as much of it as we can,
+  // so that many requests can be in flight at once.
   uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
-  if(max < NUM)
+  disk.num = NUM;
+  while(disk.num > max)
+    disk.num /= 2;
+  if(disk.num < MAXIOBLOCKS+2)
     panic("virtio disk max queue too short");
 
   // allocate and zero queue memory.
@@ -128,7 +133,7 @@ virtio_disk_init(void)
   memset(disk.used, 0, PGSIZE);
 
   // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  *R(VIRTIO_MMIO_QUEUE_NUM) = disk.num;
 
   // write physical addresses.
   *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
@@ -141,8 +146,8 @@ virtio_disk_init(void)
   // queue is ready.
   *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
 
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
+  // all num descriptors start out unused.
+  for(int i = 0; i < disk.num; i++)
     disk.free[i] = 1;
 
   // tell device we're completely ready.
@@ -156,7 +161,7 @@ virtio_disk_init(void)
 static int
 alloc_desc()
 {
-  for(int i = 0; i < NUM; i++){
+  for(int i = 0; i < disk.num; i++){
     if(disk.free[i]){
       disk.free[i] = 0;
       return i;
@@ -169,7 +174,7 @@ alloc_desc()
 static void
 free_desc(int i)
 {
-  if(i >= NUM)
+  if(i >= disk.num)
     panic("free_desc 1");
   if(disk.free[i])
     panic("free_desc 2");
@@ -196,12 +201,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,27 +216,37 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// queue a read or write of the n buffers in bs, which hold
+// consecutive blocks, as one request without waiting for it.
+// caller must hold disk.vdisk_lock.
+// may sleep until enough descriptors are free.
+static void
+virtio_disk_submit(struct buf **bs, int n, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
-
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
+  uint64 sector = bs[0]->blockno * (BSIZE / 512);
+
+  if(n < 1 || n > MAXIOBLOCKS)
+    panic("virtio_disk_submit n");
+  for(int i = 1; i < n; i++)
+    if(bs[i]->blockno != bs[0]->blockno + i)
+      panic("virtio_disk_submit blockno");
+
+  // the spec's Section 5.2 says that block operations use
+  // a descriptor for type/reserved/sector, then descriptors
+  // for the data, then one for a 1-byte status result.
+  // the data descriptors scatter the request's consecutive
+  // sectors across the n buffers.
+
+  // allocate the n+2 descriptors.
+  int idx[MAXIOBLOCKS+2];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(alloc_descs(idx, n+2) == 0) {
       break;
     }
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -249,48 +263,80 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 1; i <= n; i++){
+    disk.desc[idx[i]].addr = (uint64) bs[i-1]->data;
+    disk.desc[idx[i]].len = BSIZE;
+    if(write)
+      disk.desc[idx[i]].flags = 0; // device reads b->data
+    else
+      disk.desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i]].next = idx[i+1];
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
+
+  // record the struct bufs for virtio_disk_intr().
+  for(int i = 0; i < n; i++){
+    bs[i]->disk = 1;
+    bs[i]->ionext = i+1 < n ? bs[i+1] : 0;
+  }
+  disk.info[idx[0]].b = bs[0];
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  disk.avail->ring[disk.avail->idx % disk.num] = idx[0];
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  disk.avail->idx += 1; // not % num ...
 
   __sync_synchronize();
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
+
+// start reading or writing the n buffers in bs, which must
+// hold consecutive blocks, and return without waiting.
+// when the disk is done, virtio_disk_intr() calls b->iodone(b)
+// for each b that has it set, and wakes up virtio_disk_wait(b)
+// for the others.
+void
+virtio_disk_start(struct buf **bs, int n, int write)
+{
+  acquire(&disk.vdisk_lock);
+  virtio_disk_submit(bs, n, write);
+  release(&disk.vdisk_lock);
+}
+
+// wait for the request started on b, if any, to finish.
+// b->iodone must be 0.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
 
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
+// read or write b, and wait for the disk to finish.
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  b->iodone = 0;
+  virtio_disk_start(&b, 1, write);
+  virtio_disk_wait(b);
+}
+
 void
 virtio_disk_intr()
 {
@@ -311,14 +357,27 @@ virtio_disk_intr()
 
   while(disk.used_idx != disk.used->idx){
     __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+    int id = disk.used->ring[disk.used_idx % disk.num].id;
 
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
     struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    disk.info[id].b = 0;
+    free_chain(id);
+
+    while(b){
+      struct buf *next = b->ionext;
+      void (*done)(struct buf*) = b->iodone;
+      b->ionext = 0;
+      b->iodone = 0;
+      b->disk = 0;   // disk is done with buf
+      if(done)
+        done(b);  // may release b, so don't look at it again
+      else
+        wakeup(b);
+      b = next;
+    }
 
     disk.used_idx += 1;
   }
@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -33,6 +35,10 @@ kvmmake(void)
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
+  // CLINT, for inter-processor interrupts and to stop the
+  // timer on idle CPUs.
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
@@ -172,7 +178,8 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never faulted in (see
+// uvmfault()) are skipped.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
@@ -185,9 +192,9 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -303,10 +310,12 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, map its
+// memory into a child's page table.
+// The physical pages are shared rather than copied:
+// writable pages become read-only and copy-on-write
+// in both page tables, and uvmcow() gives a process
+// its own copy the first time it writes to one.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
@@ -315,22 +324,17 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+    if((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;  // not yet faulted in; the child will fault it too.
     pa = PTE2PA(*pte);
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    krefinc((void*)pa);
   }
   return 0;
 
@@ -339,6 +343,196 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   return -1;
 }
 
+// Resolve a write to the copy-on-write page containing va:
+// copy it into a fresh page, or simply make it writable if
+// no other page table still refers to it.
+// Returns 0 on success, -1 if va is not a copy-on-write
+// user page or memory is exhausted.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
+     (*pte & PTE_COW) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  // the last reference can't be shared again behind our back:
+  // only this process could fork it, and it is here.
+  if(krefcnt((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  return 0;
+}
+
+// Return the segment of p's program that contains va, or 0.
+static struct vmseg*
+uvmseg(struct proc *p, uint64 va)
+{
+  struct vmseg *s;
+
+  for(s = p->seg; s < &p->seg[NSEG]; s++)
+    if(s->memsz > 0 && va >= s->va && va < s->va + s->memsz)
+      return s;
+  return 0;
+}
+
+// Read the part of segment s that lies in the page at va
+// from p's executable into mem, which must be zeroed.
+// Returns 0 on success, -1 on error.
+static int
+uvmload(struct proc *p, struct vmseg *s, uint64 va, char *mem)
+{
+  uint64 off = va - s->va;
+  uint n;
+  int r;
+
+  if(off >= s->filesz)
+    return 0;  // all bss
+  n = s->filesz - off;
+  if(n > PGSIZE)
+    n = PGSIZE;
+  ilockshared(p->exe);
+  r = readi(p->exe, 0, (uint64)mem, s->off + off, n);
+  iunlockshared(p->exe);
+  return r == n ? 0 : -1;
+}
+
+// Handle a page fault at va in process p.
+// Nothing below p->sz is mapped until it is first touched:
+// program pages are read in from p->exe (see exec()), or
+// shared through the text cache if read-only, and
+// heap pages, which sbrk() only reserves, are zero-filled.
+// Writes to copy-on-write pages are resolved by uvmcow().
+// May sleep reading the executable, so no spinlocks
+// may be held for a fault on a program page.
+// Returns 0 if the fault was resolved, -1 if the access
+// is illegal or memory is exhausted.
+int
+uvmfault(struct proc *p, uint64 va, int write)
+{
+  pagetable_t pagetable = p->pagetable;
+  struct vmseg *s;
+  pte_t *pte;
+  char *mem;
+  int perm;
+
+  if(va >= p->sz || va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if(write && (*pte & PTE_COW))
+      return uvmcow(pagetable, va);
+    return -1;
+  }
+
+  perm = PTE_R|PTE_W|PTE_U;
+  if((s = uvmseg(p, va)) != 0){
+    if(write && (s->perm & PTE_W) == 0)
+      return -1;
+    perm = PTE_R|PTE_U|s->perm;
+  }
+
+  if(s && (s->perm & (PTE_X|PTE_W)) == PTE_X && va - s->va < s->filesz){
+    // read-only text: share one copy among all processes
+    // running this program.
+    uint64 off = va - s->va;
+    uint n = s->filesz - off < PGSIZE ? s->filesz - off : PGSIZE;
+    if((mem = textget(p->exe, s->off + off, n)) == 0)
+      return -1;
+  } else {
+    if((mem = kalloc()) == 0)
+      return -1;
+    memset(mem, 0, PGSIZE);
+    if(s && uvmload(p, s, va, mem) != 0){
+      kfree(mem);
+      return -1;
+    }
+  }
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Fault in any program pages of the current process in
+// [va, va+len) that have not been loaded yet, so that a
+// system call can copy to or from them while holding locks
+// (e.g. a pipe's spinlock, or another inode's sleep-lock).
+// Returns -1 if a page could not be loaded.
+int
+uvmprefault(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vmseg *s;
+  uint64 a, start, end;
+  pte_t *pte;
+
+  if(va + len < va)
+    return 0;  // copyin()/copyout() will reject it.
+  for(s = p->seg; s < &p->seg[NSEG]; s++){
+    if(s->memsz == 0)
+      continue;
+    start = va > s->va ? va : s->va;
+    end = va + len < s->va + s->memsz ? va + len : s->va + s->memsz;
+    for(a = PGROUNDDOWN(start); a < end; a += PGSIZE){
+      pte = walk(p->pagetable, a, 0);
+      if(pte && (*pte & PTE_V))
+        continue;
+      if(uvmfault(p, a, 0) != 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+// Return the physical address of the user page at page-aligned
+// va, for copyin() and copyout(). Pages of the current process
+// that have not been faulted in yet, or, if write is set, that
+// are copy-on-write, are resolved as usertrap() would (callers
+// holding locks must uvmprefault() program pages first). Other
+// page tables (e.g. the image exec() is building) must already
+// be mapped. Returns 0 if va is not accessible.
+static uint64
+uvmpage(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (write && (*pte & PTE_W) == 0)){
+    if(p == 0 || p->pagetable != pagetable)
+      return 0;
+    if(uvmfault(p, va, write) != 0)
+      return 0;
+    pte = walk(pagetable, va, 0);
+  }
+  if((*pte & PTE_U) == 0 || (write && (*pte & PTE_W) == 0))
+    return 0;
+  return PTE2PA(*pte);
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -359,17 +553,12 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
-  pte_t *pte;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    if(va0 >= MAXVA)
-      return -1;
-    pte = walk(pagetable, va0, 0);
-    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
-       (*pte & PTE_W) == 0)
+    pa0 = uvmpage(pagetable, va0, 1);
+    if(pa0 == 0)
       return -1;
-    pa0 = PTE2PA(*pte);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -392,7 +581,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmpage(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -419,7 +608,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmpage(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
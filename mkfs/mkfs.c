@@ -22,7 +22,7 @@
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = 2*(LOGSIZE+1);  // two halves, see kernel/log.c
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -235,16 +235,18 @@ void
 balloc(int used)
 {
   uchar buf[BSIZE];
-  int i;
+  int i, b;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  assert(used < nbitmap*BPB);
+  for(b = 0; b*BPB < used; b++){
+    bzero(buf, BSIZE);
+    for(i = 0; i < BPB && b*BPB + i < used; i++){
+      buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    }
+    printf("balloc: write bitmap block at sector %d\n", sb.bmapstart+b);
+    wsect(sb.bmapstart+b, buf);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
@@ -257,7 +259,7 @@ iappend(uint inum, void *xp, int n)
   struct dinode din;
   char buf[BSIZE];
   uint indirect[NINDIRECT];
-  uint x;
+  uint x, bn, level, span, *ap;
 
   rinode(inum, &din);
   off = xint(din.size);
@@ -271,15 +273,26 @@ iappend(uint inum, void *xp, int n)
       }
       x = xint(din.addrs[fbn]);
     } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+      // find the indirect tree that holds fbn, as bmap() does.
+      bn = fbn - NDIRECT;
+      for(level = 1, span = NINDIRECT; bn >= span; level++, span *= NINDIRECT)
+        bn -= span;
+      ap = &din.addrs[NDIRECT+level-1];
+      for(; level > 0; level--){
+        if(xint(*ap) == 0){
+          *ap = xint(freeblock++);
+        }
+        x = xint(*ap);
+        span /= NINDIRECT;
+        rsect(x, (char*)indirect);
+        if(indirect[bn / span] == 0){
+          indirect[bn / span] = xint(freeblock++);
+          wsect(x, (char*)indirect);
+        }
+        ap = &indirect[bn / span];
+        bn %= span;
       }
-      x = xint(indirect[fbn-NDIRECT]);
+      x = xint(*ap);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
@@ -0,0 +1,68 @@
+// print lock contention statistics: totals since boot,
+// or, given a command, what happened while it ran.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/lockstat.h"
+#include "user/user.h"
+
+#define NLS 64
+
+struct lockstat before[NLS], after[NLS];
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, nb, na, pid;
+  struct lockstat t;
+
+  nb = 0;
+  if(argc > 1){
+    if((nb = lockstat(before, NLS)) < 0){
+      fprintf(2, "lockstat: failed\n");
+      exit(1);
+    }
+    pid = fork();
+    if(pid < 0){
+      fprintf(2, "lockstat: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      exec(argv[1], argv+1);
+      fprintf(2, "lockstat: exec %s failed\n", argv[1]);
+      exit(1);
+    }
+    wait(0);
+  }
+  if((na = lockstat(after, NLS)) < 0){
+    fprintf(2, "lockstat: failed\n");
+    exit(1);
+  }
+
+  // subtract the counts from before the command.
+  for(i = 0; i < na; i++){
+    for(j = 0; j < nb; j++){
+      if(strcmp(after[i].name, before[j].name) == 0){
+        after[i].nacquire -= before[j].nacquire;
+        after[i].nspin -= before[j].nspin;
+        break;
+      }
+    }
+  }
+
+  // most contended first.
+  for(i = 1; i < na; i++){
+    t = after[i];
+    for(j = i; j > 0 && after[j-1].nspin < t.nspin; j--)
+      after[j] = after[j-1];
+    after[j] = t;
+  }
+
+  printf("lock acquires spins\n");
+  for(i = 0; i < na; i++){
+    if(after[i].nacquire == 0)
+      continue;
+    printf("%s %l %l\n", after[i].name, after[i].nacquire, after[i].nspin);
+  }
+  exit(0);
+}
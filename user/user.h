@@ -1,4 +1,5 @@
 struct stat;
+struct lockstat;
 
 // system calls
 int fork(void);
@@ -22,6 +23,8 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int setpriority(int, int);
+int lockstat(struct lockstat*, int);
 // ulib.c
 int stat(const char*, struct stat*);
 char* strcpy(char*, const char*);
@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/lockstat.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -575,6 +576,10 @@ writetest(char *s)
   }
 }
 
+// MAXFILE blocks would not fit on the disk; write enough
+// to get well into the doubly-indirect blocks.
+#define NBIG (NDIRECT + NINDIRECT + 2*NINDIRECT)
+
 void
 writebig(char *s)
 {
@@ -586,7 +591,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < NBIG; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -606,7 +611,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != NBIG){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -2571,6 +2576,764 @@ badarg(char *s)
   exit(0);
 }
 
+// fork() shares memory copy-on-write, so a process using well
+// over half of physical memory can still fork, and parent and
+// child each see only their own writes, including writes the
+// kernel makes on their behalf with copyout().
+void
+cowfork(char *s)
+{
+  uint64 sz = (PHYSTOP - KERNBASE) / 2 + (PHYSTOP - KERNBASE) / 8;
+  int fds[2], pid, xstatus;
+  char *p, *a;
+
+  p = sbrk(sz);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(a = p; a < p + sz; a += PGSIZE)
+    *(int*)a = 1;
+
+  for(int i = 0; i < 3; i++){
+    if(pipe(fds) < 0){
+      printf("%s: pipe failed\n", s);
+      exit(1);
+    }
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[1]);
+      for(a = p; a < p + sz; a += 64*PGSIZE)
+        *(int*)a = 2;
+      if(read(fds[0], p + PGSIZE, sizeof(int)) != sizeof(int))
+        exit(1);
+      exit(*(int*)(p + PGSIZE) == 3 ? 0 : 1);
+    }
+    close(fds[0]);
+    int x = 3;
+    if(write(fds[1], &x, sizeof(x)) != sizeof(x)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+    close(fds[1]);
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: child failed\n", s);
+      exit(1);
+    }
+    for(a = p; a < p + sz; a += PGSIZE){
+      if(*(int*)a != 1){
+        printf("%s: parent saw child's write at %p\n", s, a);
+        exit(1);
+      }
+    }
+  }
+
+  sbrk(-sz);
+}
+
+// sbrk() only reserves address space, so a reservation much
+// larger than physical memory succeeds, and pages are allocated
+// (zero-filled) as they are touched, whether by the process, by
+// system calls that copy in or out of them, or after a fork.
+void
+sbrklazy(char *s)
+{
+  enum { HUGE=1024*1024*1024 };
+  char *a, *p;
+  int fds[2], pid, xstatus;
+
+  a = sbrk(HUGE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(HUGE) failed\n", s);
+    exit(1);
+  }
+
+  // sparse touches.
+  for(p = a; p < a + HUGE; p += HUGE/16){
+    if(*p != 0){
+      printf("%s: lazy page not zero\n", s);
+      exit(1);
+    }
+    *p = 'x';
+  }
+
+  // copyout() and copyin() to pages never touched.
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], a + HUGE/32, 8) != 8){
+    printf("%s: write from lazy page failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], a + HUGE/32 + HUGE/64, 8) != 8){
+    printf("%s: read into lazy page failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  // fork() copies a page table full of holes.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(p = a; p < a + HUGE; p += HUGE/16)
+      if(*p != 'x')
+        exit(1);
+    *(a + HUGE - 1) = 1;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong memory\n", s);
+    exit(1);
+  }
+
+  if(sbrk(-HUGE) != a + HUGE){
+    printf("%s: sbrk(-HUGE) failed\n", s);
+    exit(1);
+  }
+}
+
+// files created with O_EXTENT map their blocks with extents.
+// write two at once, so that their blocks interleave and they
+// need more extents than fit in the inode.
+void
+extentfile(char *s)
+{
+  enum { N = NIEXTENT + 40 };
+  char *names[2] = { "ext0", "ext1" };
+  int fds[2], i, f, n;
+  struct stat st;
+
+  for(f = 0; f < 2; f++){
+    unlink(names[f]);
+    fds[f] = open(names[f], O_CREATE|O_RDWR|O_EXTENT);
+    if(fds[f] < 0){
+      printf("%s: create %s failed\n", s, names[f]);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    for(f = 0; f < 2; f++){
+      memset(buf, 'a' + f, BSIZE);
+      ((int*)buf)[0] = i;
+      if(write(fds[f], buf, BSIZE) != BSIZE){
+        printf("%s: write %s block %d failed\n", s, names[f], i);
+        exit(1);
+      }
+    }
+  }
+  for(f = 0; f < 2; f++){
+    close(fds[f]);
+    fds[f] = open(names[f], O_RDONLY);
+    if(fds[f] < 0 || fstat(fds[f], &st) < 0 || st.size != N*BSIZE){
+      printf("%s: %s has wrong size\n", s, names[f]);
+      exit(1);
+    }
+    for(i = 0; (n = read(fds[f], buf, BSIZE)) == BSIZE; i++){
+      if(((int*)buf)[0] != i || buf[BSIZE-1] != 'a' + f){
+        printf("%s: %s block %d has wrong content\n", s, names[f], i);
+        exit(1);
+      }
+    }
+    if(n != 0 || i != N){
+      printf("%s: read %d blocks of %s\n", s, i, names[f]);
+      exit(1);
+    }
+    close(fds[f]);
+    if(unlink(names[f]) < 0){
+      printf("%s: unlink %s failed\n", s, names[f]);
+      exit(1);
+    }
+  }
+}
+
+// path lookups go through the directory-entry cache; check
+// that unlink(), link(), re-creating a file and removing a
+// directory all keep it in step with the directories.
+void
+dcache(char *s)
+{
+  struct stat st, st1;
+  int fd, fd1;
+
+  // a name that has been looked up is gone once unlinked.
+  unlink("dc1");
+  if((fd = open("dc1", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create dc1 failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if((fd = open("dc1", O_RDONLY)) < 0){
+    printf("%s: open dc1 failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(unlink("dc1") < 0){
+    printf("%s: unlink dc1 failed\n", s);
+    exit(1);
+  }
+  if(open("dc1", O_RDONLY) >= 0){
+    printf("%s: opened dc1 after unlink\n", s);
+    exit(1);
+  }
+
+  // a name added by link() resolves, to the same inode,
+  // even after it was looked up and not found.
+  if((fd = open("dc1", O_CREATE|O_RDWR)) < 0 || fstat(fd, &st) < 0){
+    printf("%s: create dc1 failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(open("dc2", O_RDONLY) >= 0){
+    printf("%s: dc2 exists\n", s);
+    exit(1);
+  }
+  if(link("dc1", "dc2") < 0){
+    printf("%s: link dc1 dc2 failed\n", s);
+    exit(1);
+  }
+  if((fd = open("dc2", O_RDONLY)) < 0 || fstat(fd, &st1) < 0){
+    printf("%s: open dc2 after link failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(st1.ino != st.ino){
+    printf("%s: dc2 is inode %d, not %d\n", s, st1.ino, st.ino);
+    exit(1);
+  }
+  unlink("dc2");
+
+  // re-create dc1 while the old one is still open, so that
+  // it gets a new inode; lookups must find the new one.
+  if((fd = open("dc1", O_RDONLY)) < 0){
+    printf("%s: open dc1 failed\n", s);
+    exit(1);
+  }
+  unlink("dc1");
+  if((fd1 = open("dc1", O_CREATE|O_RDWR)) < 0 || fstat(fd1, &st1) < 0){
+    printf("%s: re-create dc1 failed\n", s);
+    exit(1);
+  }
+  close(fd1);
+  close(fd);
+  if(st1.ino == st.ino){
+    printf("%s: re-created dc1 has the old inode\n", s);
+    exit(1);
+  }
+  if((fd = open("dc1", O_RDONLY)) < 0 || fstat(fd, &st) < 0){
+    printf("%s: open re-created dc1 failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(st.ino != st1.ino){
+    printf("%s: dc1 is stale inode %d, not %d\n", s, st.ino, st1.ino);
+    exit(1);
+  }
+  unlink("dc1");
+
+  // the entries of a removed directory go with it: if its
+  // inode becomes a file, "file/." must not find the file.
+  if(mkdir("dcd") < 0){
+    printf("%s: mkdir dcd failed\n", s);
+    exit(1);
+  }
+  if((fd = open("dcd/.", O_RDONLY)) < 0 || fstat(fd, &st) < 0){
+    printf("%s: open dcd/. failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(unlink("dcd") < 0){
+    printf("%s: unlink dcd failed\n", s);
+    exit(1);
+  }
+  if((fd = open("dcf", O_CREATE|O_RDWR)) < 0 || fstat(fd, &st1) < 0){
+    printf("%s: create dcf failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(open("dcf/.", O_RDONLY) >= 0){
+    printf("%s: opened dcf/. (inode %d, dcd was %d)\n", s, st1.ino, st.ino);
+    exit(1);
+  }
+  unlink("dcf");
+}
+
+// the kernel's hash of a directory entry name; see dirhash().
+static uint
+namehash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261;
+  for(i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// set name to "x" and the five digits of i.
+static void
+xname(char *name, int i)
+{
+  int j;
+
+  name[0] = 'x';
+  for(j = 5; j > 0; j--, i /= 10)
+    name[j] = '0' + i % 10;
+  name[6] = '\0';
+}
+
+// directories made by mkdir have a hash index; check that
+// lookups, unlinks and slot reuse agree with the entries
+// that read() of the directory shows, and that lookups still
+// work once a bucket overflows and the directory goes back
+// to linear scans. N stays well below the free inodes that
+// mkfs leaves.
+void
+hashdir(char *s)
+{
+  enum { N = 150, NOVER = NINDIRECT + 8 };
+  char name[8];
+  struct dirent de;
+  int i, fd, n, last;
+  uint b;
+
+  if(mkdir("hd") < 0){
+    printf("%s: mkdir hd failed\n", s);
+    exit(1);
+  }
+  if(chdir("hd") < 0){
+    printf("%s: chdir hd failed\n", s);
+    exit(1);
+  }
+  name[0] = 'h';
+  name[4] = '\0';
+  for(i = 0; i < N; i++){
+    name[1] = '0' + i / 100;
+    name[2] = '0' + (i / 10) % 10;
+    name[3] = '0' + i % 10;
+    fd = open(name, O_CREATE|O_RDWR);
+    if(fd < 0){
+      printf("%s: create %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+  }
+  for(i = 0; i < N; i += 2){
+    name[1] = '0' + i / 100;
+    name[2] = '0' + (i / 10) % 10;
+    name[3] = '0' + i % 10;
+    if(unlink(name) < 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    name[1] = '0' + i / 100;
+    name[2] = '0' + (i / 10) % 10;
+    name[3] = '0' + i % 10;
+    fd = open(name, O_RDONLY);
+    if((fd >= 0) != (i % 2 == 1)){
+      printf("%s: open %s returned %d\n", s, name, fd);
+      exit(1);
+    }
+    if(fd >= 0)
+      close(fd);
+  }
+
+  fd = open(".", O_RDONLY);
+  n = 0;
+  while(read(fd, &de, sizeof(de)) == sizeof(de)){
+    if(de.inum == 0)
+      continue;
+    if(de.name[0] == 'h')
+      n++;
+    else if(strcmp(de.name, ".") != 0 && strcmp(de.name, "..") != 0){
+      printf("%s: stray entry %s\n", s, de.name);
+      exit(1);
+    }
+  }
+  close(fd);
+  if(n != N/2){
+    printf("%s: read %d entries, expected %d\n", s, n, N/2);
+    exit(1);
+  }
+
+  for(i = 1; i < N; i += 2){
+    name[1] = '0' + i / 100;
+    name[2] = '0' + (i / 10) % 10;
+    name[3] = '0' + i % 10;
+    if(unlink(name) < 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  if(chdir("..") < 0 || unlink("hd") < 0){
+    printf("%s: remove hd failed\n", s);
+    exit(1);
+  }
+
+  // link one file under more names than a bucket holds, all
+  // hashing to the same bucket. Links need no new inodes.
+  if(mkdir("hx") < 0 || chdir("hx") < 0){
+    printf("%s: mkdir hx failed\n", s);
+    exit(1);
+  }
+  if((fd = open("t", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create t failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  xname(name, 0);
+  b = namehash(name) % DIRNBUCKET;
+  for(i = 0, n = 0; n < NOVER; i++){
+    xname(name, i);
+    if(namehash(name) % DIRNBUCKET != b)
+      continue;
+    if(link("t", name) < 0){
+      printf("%s: link %s failed\n", s, name);
+      exit(1);
+    }
+    n++;
+  }
+  last = i;
+
+  // every name must still be found, and a name in the same
+  // bucket that was never linked must not be.
+  for(i = 0; ; i++){
+    xname(name, i);
+    if(namehash(name) % DIRNBUCKET != b)
+      continue;
+    fd = open(name, O_RDONLY);
+    if((fd >= 0) != (i < last)){
+      printf("%s: open %s returned %d\n", s, name, fd);
+      exit(1);
+    }
+    if(fd < 0)
+      break;
+    close(fd);
+  }
+
+  for(i = 0; i < last; i++){
+    xname(name, i);
+    if(namehash(name) % DIRNBUCKET != b)
+      continue;
+    if(unlink(name) < 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+    if(open(name, O_RDONLY) >= 0){
+      printf("%s: opened %s after unlink\n", s, name);
+      exit(1);
+    }
+  }
+  if(unlink("t") < 0 || chdir("..") < 0 || unlink("hx") < 0){
+    printf("%s: remove hx failed\n", s);
+    exit(1);
+  }
+}
+
+// hold more inodes open at once than NINODE, which the
+// in-memory inode table must be bigger than. Each child has
+// 5 descriptors open already, so NPER more fit in NOFILE,
+// and the NCHILD*NPER files and the pipes fit in NFILE.
+void
+manyinodes(char *s)
+{
+  enum { NCHILD = 8, NPER = 8 };
+  char name[4];
+  int fds[2], ready[2], c, i, fd, xstatus;
+  char x;
+
+  if(pipe(fds) < 0 || pipe(ready) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  name[0] = 'm';
+  name[3] = '\0';
+  for(c = 0; c < NCHILD; c++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[1]);
+      close(ready[0]);
+      name[1] = 'a' + c;
+      for(i = 0; i < NPER; i++){
+        name[2] = 'a' + i;
+        if(open(name, O_CREATE|O_RDWR) < 0){
+          printf("%s: create %s failed\n", s, name);
+          exit(1);
+        }
+        unlink(name);
+      }
+      // keep the files open until the parent is done.
+      write(ready[1], "x", 1);
+      read(fds[0], &x, 1);
+      exit(0);
+    }
+  }
+  close(fds[0]);
+  close(ready[1]);
+
+  // with every child's files open, there are more active
+  // inodes than NINODE; creating one more must still work.
+  for(c = 0; c < NCHILD; c++){
+    if(read(ready[0], &x, 1) != 1){
+      printf("%s: child failed\n", s);
+      exit(1);
+    }
+  }
+  close(ready[0]);
+  fd = open("mzz", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create mzz failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mzz");
+
+  close(fds[1]);
+  for(c = 0; c < NCHILD; c++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+}
+
+// spin for n iterations.
+static void
+spinfor(uint n)
+{
+  volatile uint i;
+
+  for(i = 0; i < n; i++)
+    ;
+}
+
+// a CPU-bound process at the lowest level must still get
+// to run, a process can't be given a level that doesn't
+// exist, and with every CPU busy at the lowest level, a
+// CPU-bound process at the highest level finishes its work
+// ahead of one at the lowest that started first.
+void
+setprio(char *s)
+{
+  enum { NSPIN = 4*NCPU };
+  int pid, xstatus, t0, i, hi, lo, first;
+  int spinners[NSPIN];
+  uint n;
+
+  if(setpriority(getpid(), -1) != -1 || setpriority(getpid(), NPRIO) != -1){
+    printf("%s: setpriority accepted a bad level\n", s);
+    exit(1);
+  }
+  if(setpriority(-1, 0) != -1){
+    printf("%s: setpriority accepted a bad pid\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(setpriority(getpid(), NPRIO-1) < 0)
+      exit(1);
+    t0 = uptime();
+    while(uptime() < t0 + 5)
+      ;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: low priority child failed\n", s);
+    exit(1);
+  }
+
+  // how much spinning is two ticks' worth?
+  t0 = uptime();
+  while(uptime() == t0)
+    ;
+  t0 = uptime();
+  for(n = 0; uptime() < t0 + 2; n += 1000)
+    spinfor(1000);
+
+  // keep every CPU busy at the lowest level, with several
+  // processes queued ahead of any newcomer there.
+  for(i = 0; i < NSPIN; i++){
+    if((spinners[i] = fork()) < 0)
+      break;
+    if(spinners[i] == 0){
+      setpriority(getpid(), NPRIO-1);
+      for(;;)
+        spinfor(1000);
+    }
+  }
+
+  lo = hi = -1;
+  if(i == NSPIN && (lo = fork()) == 0){
+    setpriority(getpid(), NPRIO-1);
+    spinfor(n);
+    exit(0);
+  }
+  if(lo > 0 && (hi = fork()) == 0){
+    spinfor(n);
+    exit(0);
+  }
+  first = -1;
+  if(lo > 0)
+    first = wait(0);
+  if(hi > 0)
+    wait(0);
+  while(--i >= 0){
+    kill(spinners[i]);
+    wait(0);
+  }
+  if(lo < 0 || hi < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(first != hi){
+    printf("%s: low priority child finished first\n", s);
+    exit(1);
+  }
+}
+
+// while a program runs, page faults read it from its file,
+// so the file can't be opened for writing.
+void
+textbusy(char *s)
+{
+  int fd;
+
+  if((fd = open("/usertests", O_RDWR)) >= 0 ||
+     (fd = open("/usertests", O_WRONLY|O_TRUNC)) >= 0){
+    printf("%s: opened running program for writing\n", s);
+    exit(1);
+  }
+  if((fd = open("/usertests", O_RDONLY)) < 0){
+    printf("%s: open running program for reading failed\n", s);
+    exit(1);
+  }
+  close(fd);
+}
+
+// lockstat() reports the reader-writer locks as well as the
+// spinlocks.
+struct lockstat lsbefore[64], lsafter[64];
+
+void
+lockstats(char *s)
+{
+  int nb, na, i, j, fd;
+
+  if(lockstat(lsbefore, -1) >= 0){
+    printf("%s: lockstat accepted a negative count\n", s);
+    exit(1);
+  }
+  if((nb = lockstat(lsbefore, 64)) <= 0){
+    printf("%s: lockstat failed\n", s);
+    exit(1);
+  }
+  // each open() looks up inodes in the table, under an
+  // itable.bucket lock.
+  for(i = 0; i < 10; i++){
+    if((fd = open("/usertests", O_RDONLY)) < 0){
+      printf("%s: open failed\n", s);
+      exit(1);
+    }
+    close(fd);
+  }
+  if((na = lockstat(lsafter, 64)) <= 0){
+    printf("%s: lockstat failed\n", s);
+    exit(1);
+  }
+
+  for(j = 0; j < na; j++)
+    if(strcmp(lsafter[j].name, "itable.bucket") == 0)
+      break;
+  for(i = 0; i < nb; i++)
+    if(strcmp(lsbefore[i].name, "itable.bucket") == 0)
+      break;
+  if(j == na){
+    printf("%s: no statistics for itable.bucket\n", s);
+    exit(1);
+  }
+  if(lsafter[j].nacquire < (i < nb ? lsbefore[i].nacquire : 0) + 10 ||
+     (i < nb && lsafter[j].nspin < lsbefore[i].nspin)){
+    printf("%s: itable.bucket acquisitions not counted\n", s);
+    exit(1);
+  }
+}
+
+// several processes read the same file at once, each through
+// its own file descriptor, so that they hold the inode shared.
+void
+concreads(char *s)
+{
+  enum { NCHILD = 4, NBLK = 20 };
+  int c, i, fd, xstatus;
+
+  fd = open("cr", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create cr failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NBLK; i++){
+    memset(buf, 'a' + i, BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write cr failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  for(c = 0; c < NCHILD; c++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(int round = 0; round < 10; round++){
+        if((fd = open("cr", O_RDONLY)) < 0)
+          exit(1);
+        for(i = 0; i < NBLK; i++){
+          if(read(fd, buf, BSIZE) != BSIZE || buf[0] != 'a' + i ||
+             buf[BSIZE-1] != 'a' + i){
+            printf("%s: bad data in block %d\n", s, i);
+            exit(1);
+          }
+        }
+        close(fd);
+      }
+      exit(0);
+    }
+  }
+  for(c = 0; c < NCHILD; c++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  unlink("cr");
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2635,6 +3398,16 @@ struct test {
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
   {badarg, "badarg" },
+  {cowfork, "cowfork"},
+  {sbrklazy, "sbrklazy"},
+  {extentfile, "extentfile"},
+  {hashdir, "hashdir"},
+  {dcache, "dcache"},
+  {manyinodes, "manyinodes"},
+  {setprio, "setprio"},
+  {concreads, "concreads"},
+  {textbusy, "textbusy"},
+  {lockstats, "lockstats"},
 
   { 0, 0},
 };
@@ -2924,6 +3697,52 @@ outofinodes(char *s)
   }
 }
 
+// write a file that reaches into the triply-indirect blocks,
+// read it back, and free it.
+void
+hugefile(char *s)
+{
+  int fd, n, i;
+  enum { NHUGE = NDIRECT + NINDIRECT + NDINDIRECT + NINDIRECT };
+
+  unlink("huge");
+  fd = open("huge", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create huge failed\n", s);
+    exit(1);
+  }
+  for(n = 0; n < NHUGE; n++){
+    ((int*)buf)[0] = n;
+    ((int*)buf)[BSIZE/sizeof(int)-1] = ~n;
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write huge block %d failed\n", s, n);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fd = open("huge", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open huge failed\n", s);
+    exit(1);
+  }
+  for(n = 0; (i = read(fd, buf, BSIZE)) == BSIZE; n++){
+    if(((int*)buf)[0] != n || ((int*)buf)[BSIZE/sizeof(int)-1] != ~n){
+      printf("%s: huge block %d has wrong content\n", s, n);
+      exit(1);
+    }
+  }
+  close(fd);
+  if(i != 0 || n != NHUGE){
+    printf("%s: read %d of %d huge blocks\n", s, n, NHUGE);
+    exit(1);
+  }
+  if(unlink("huge") < 0){
+    printf("%s: unlink huge failed\n", s);
+    exit(1);
+  }
+}
+
 struct test slowtests[] = {
   {bigdir, "bigdir"},
   {manywrites, "manywrites"},
@@ -2931,6 +3750,7 @@ struct test slowtests[] = {
   {execout, "execout"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
+  {hugefile, "hugefile"},
     
   { 0, 0},
 };